@@ -60,32 +60,15 @@ start:
 	or eax, 0x3
 	mov dword [PHYS(boot_page_directory.last_entry)], eax
 
-	; Map the kernel page table in the page directory.
-	mov eax, PHYS(high_kernel_page_table)
-	or eax, 0x3
-	mov dword [PHYS(boot_page_directory.kernel_entry)], eax
-
-	mov eax, 0
-	mov edx, 0
-.fill_page:				; Fill the page table containing the high memory kernel
-	mov ecx, edx
-	or ecx, 0x3			; Present + Writtable
-	mov edi, PHYS(high_kernel_page_table)
-	mov [edi + eax * 4], ecx
-	add edx, 4096
-	inc eax
-	cmp eax, 1024
-	jne .fill_page			; Works because jmp are relative, no need to use PHYS().
-
 	mov eax, PHYS(boot_page_directory)
 	mov cr3, eax			; Load page directory
 
 	mov eax, cr4
-	or eax, 0x00000010		; Enbable 4MiB pages
+	or eax, 0x00000090		; Enbable 4MiB pages and global pages
 	mov cr4, eax
 
 	mov eax, cr0
-	or eax, 0x80000001		; Enable paging
+	or eax, 0x80010001		; Enable paging, and write protection in kernel mode
 	mov cr0, eax
 
 	lea eax, [.higher_half]		; Jump into virtual space
@@ -106,10 +89,6 @@ start:
 	mov eax, cr3
 	mov cr3, eax			; Reload page directory and update the TLB cache
 
-	mov eax, cr4
-	and eax, ~0x1			; Disable 4MiB pages
-	mov cr4, eax
-
 	add ebx, KERNEL_VIRTUAL_BASE
 	push ebx
 
@@ -127,15 +106,12 @@ boot_page_directory:
 	.first_entry:
 	dd 0x00000083			; Map the first entry to avoid instant-crash
 	times (KERNEL_PAGE_INDEX - 1) dd 0
-	.kernel_entry:			; Used at a later point.
-	dd 0
+	.kernel_entry:			; Map the kernel with a global 4MiB page, until arch_vmm_init()
+	dd 0x00000183
 	times (1024 - KERNEL_PAGE_INDEX - 2) dd 0
 	.last_entry:			; Used for recurse mapping
 	dd 0
 
-high_kernel_page_table:
-	times 1024 dd 0
-
 section .bss
 align 4096
 
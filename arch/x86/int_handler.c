@@ -10,7 +10,9 @@
 #include <kernel/syscall.h>
 #include <kernel/thread.h>
 #include <kernel/interrupts.h>
+#include <kernel/vaspace.h>
 #include <arch/x86/interrupts.h>
+#include <arch/x86/vmm.h>
 #include <stdio.h>
 
 __noreturn static void
@@ -30,14 +32,46 @@ x86_breakpoint_handler(struct iframe *iframe)
 	return (OK);
 }
 
+/*
+** Tells if the given address of user space belongs to a region of the current
+** virtual address space. The binary isn't made of regions, so it always does.
+*/
+static bool
+is_in_region(uintptr addr)
+{
+	struct vaspace *vaspace;
+	bool ret;
+
+	LOCK_VASPACE(state);
+	vaspace = get_current_thread()->vaspace;
+	ret = addr < vaspace->binary_limit || vma_find(vaspace, (virt_addr_t)addr) != NULL;
+	RELEASE_VASPACE(state);
+	return (ret);
+}
+
 static status_t
-x86_pagefault_handler(struct iframe *iframe __unused)
+x86_pagefault_handler(struct iframe *iframe)
 {
 	uintptr addr;
 
+	addr = get_cr2();
+
+	/* Pages of user space outside of any region can't be reserved nor shared */
+	if (GET_PD_IDX(addr) >= GET_PD_IDX(KERNEL_VIRTUAL_BASE) || is_in_region(addr))
+	{
+		/* Access to a page that isn't present: it may be reserved */
+		if (!(iframe->err_code & 0x1) && handle_lazy_fault((virt_addr_t)addr)) {
+			return (OK);
+		}
+
+		/* Write to a present page: it may be shared copy-on-write */
+		if ((iframe->err_code & 0x3) == 0x3 && handle_cow_fault((virt_addr_t)addr)) {
+			return (OK);
+		}
+	}
+
 	if (unlikely(get_current_thread()->pid == 1)) /* Usefull for boot crash */
 	{
-		addr = get_cr2();
 		printf("Page Fault at address %#p.\n"
 			"\tAddress: %#p\n"
 			"\tPresent: %y\n"
@@ -144,6 +178,15 @@ x86_syscalls_handler(struct iframe *iframe)
 		case EXECVE:
 			iframe->eax = thread_execve((char const *)iframe->edi, (int (*)(void))iframe->esi);
 			break;
+		case YIELD:
+			thread_yield();
+			break;
+		case KMEMSTAT:
+			sys_kmemstat();
+			break;
+		case NICE:
+			iframe->eax = sys_nice((int)iframe->edi);
+			break;
 		default:
 			panic("Unknown syscall %p\n", iframe->eax);
 	}
@@ -125,6 +125,16 @@ arch_pop_interrupts(int_state_t *save)
 	set_eflags(*save);
 }
 
+/*
+** Waits for the next interrupt with interrupts enabled, and disables them again
+** once it is handled.
+*/
+void
+arch_wait_interrupt(void)
+{
+	asm volatile("sti; hlt; cli" ::: "memory");
+}
+
 bool
 arch_are_int_enabled(void)
 {
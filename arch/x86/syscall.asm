@@ -48,3 +48,6 @@ SYSCALL			0x6,			sbrk
 SYSCALL			0x7,			getpid
 SYSCALL			0x8,			waitpid
 SYSCALL			0x9,			execve
+SYSCALL			0xA,			yield
+SYSCALL			0xB,			kmemstat
+SYSCALL			0xC,			nice
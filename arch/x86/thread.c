@@ -9,10 +9,13 @@
 
 #include <kernel/thread.h>
 #include <kernel/kalloc.h>
+#include <kernel/slab.h>
+#include <kernel/init.h>
 #include <arch/x86/tss.h>
 #include <string.h>
 
 static struct thread *current_thread = NULL;
+struct kmem_cache *kernel_stack_cache;
 extern struct spinlock thread_table_lock;
 
 /*
@@ -70,7 +73,7 @@ arch_init_thread(struct thread *t)
 	struct context_switch_frame *frame;
 
 	/* Allocate thread's kernel stack */
-	t->arch.kernel_stack = kalloc(DEFAULT_KERNEL_STACK_SIZE);
+	t->arch.kernel_stack = kmem_cache_alloc(kernel_stack_cache);
 	t->arch.kernel_stack_size = DEFAULT_KERNEL_STACK_SIZE;
 	assert_neq(t->arch.kernel_stack, 0);
 
@@ -95,8 +98,9 @@ arch_init_fork_thread(struct thread *t)
 	struct context_switch_frame *frame;
 
 	/* Allocate thread's kernel stack */
-	t->arch.kernel_stack = kalloc(current_thread->arch.kernel_stack_size);
-	t->arch.kernel_stack_size = current_thread->arch.kernel_stack_size;
+	assert_eq(current_thread->arch.kernel_stack_size, DEFAULT_KERNEL_STACK_SIZE);
+	t->arch.kernel_stack = kmem_cache_alloc(kernel_stack_cache);
+	t->arch.kernel_stack_size = DEFAULT_KERNEL_STACK_SIZE;
 	assert_neq(t->arch.kernel_stack, 0);
 
 	/* Copy kernel stack */
@@ -152,3 +156,12 @@ get_current_thread(void)
 {
 	return (current_thread);
 }
+
+static void
+init_kernel_stack_cache(enum init_level il __unused)
+{
+	kernel_stack_cache = kmem_cache_create("kernel_stack", DEFAULT_KERNEL_STACK_SIZE, PAGE_SIZE, NULL);
+	assert_neq(kernel_stack_cache, NULL);
+}
+
+NEW_INIT_HOOK(kernel_stack_cache, &init_kernel_stack_cache, CHAOS_INIT_LEVEL_ARCH);
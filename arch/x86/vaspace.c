@@ -10,9 +10,19 @@
 #include <kernel/vaspace.h>
 #include <kernel/thread.h>
 #include <kernel/kalloc.h>
+#include <kernel/slab.h>
+#include <kernel/interrupts.h>
+#include <kernel/unit-tests.h>
 #include <arch/x86/vmm.h>
+#include <arch/x86/asm.h>
 #include <string.h>
 
+static struct fork_stats	fork_stats;
+static struct spinlock		cow_lock;
+
+# define LOCK_COW(state)	LOCK(&cow_lock, state)
+# define RELEASE_COW(state)	RELEASE(&cow_lock, state)
+
 /*
 ** Set up a new virtual address space
 */
@@ -23,110 +33,274 @@ arch_init_vaspace(void)
 }
 
 /*
-** Clone the page table 'src' of index 'pidx' within 'dest'.
+** Clone the page table 'src' within 'dest'.
+**
+** Pages aren't copied: both page tables point to the same frames, which get an
+** other reference. Writable pages are made read-only and marked as copy-on-write
+** in both page tables, so that only the pages actually written to are copied.
+**
+** Returns the number of pages shared.
 */
-static void
-clone_page_table(struct page_table *dest, struct page_table *src, size_t pidx)
+static size_t
+clone_page_table(struct page_table *dest, struct page_table *src)
 {
-	phys_addr_t pa;
-	void *kalloc_page;
-	void *page;
+	struct pagetable_entry *pte;
+	size_t nb_shared;
 	size_t i;
 
-	kalloc_page = kalloc(2 * PAGE_SIZE); /* Dirty way to have page-aligned allocation */
-	assert_neq(kalloc_page, NULL);
-	page = (void *)ALIGN((uintptr)kalloc_page, PAGE_SIZE);
-	pa = get_paddr(page);
+	nb_shared = 0;
+	i = 0;
+	while (i < 1024)
+	{
+		pte = src->entries + i;
+		if (pte->present)
+		{
+			if (pte->rw) {
+				pte->rw = false;
+				pte->cow = true;
+			}
+			get_page(pte->frame << 12u);
+			++nb_shared;
+		}
+		dest->entries[i].value = pte->value;
+		++i;
+	}
+	return (nb_shared);
+}
+
+/*
+** Undoes clone_page_table() on the source page table, when the clone is aborted.
+**
+** The references taken on the frames are dropped, and the pages the source page
+** table holds the last reference to are made writable again, as a write to them
+** would have done.
+*/
+static void
+unclone_page_table(struct page_table *src)
+{
+	struct pagetable_entry *pte;
+	size_t i;
 
 	i = 0;
 	while (i < 1024)
 	{
-		dest->entries[i].value = src->entries[i].value;
-		if (src->entries[i].present) {
-			dest->entries[i].frame = pa >> 12u;
-			memcpy(page, GET_VADDR(pidx, i), PAGE_SIZE);
-
-			/* Set a new frame address for the next page */
-			pa = alloc_frame();
-			assert_neq(pa, NULL_FRAME);
-			set_paddr(page, pa);
+		pte = src->entries + i;
+		if (pte->present)
+		{
+			put_page(pte->frame << 12u);
+			if (pte->cow && phys_to_page(pte->frame << 12u)->refcount == 1) {
+				pte->cow = false;
+				pte->rw = true;
+			}
 		}
 		++i;
 	}
-	kfree(kalloc_page);
+}
+
+/*
+** Tells if the page directory entry at the given index covers a part of the binary
+** or of a region of the given virtual address space.
+** 'vma' is the index of the region to start looking from, and is updated so that
+** entries can be checked in increasing order without going through the regions again.
+*/
+static bool
+is_pde_in_use(struct vaspace const *vaspace, size_t pidx, size_t *vma)
+{
+	uintptr start;
+	uintptr end;
+
+	start = (uintptr)GET_VADDR(pidx, 0);
+	end = start + ARCH_LARGE_PAGE_SIZE;
+	if (start < vaspace->binary_limit) {
+		return (true);
+	}
+	while (*vma < vaspace->nb_vmas && vaspace->vmas[*vma].end <= start) {
+		++*vma;
+	}
+	return (*vma < vaspace->nb_vmas && vaspace->vmas[*vma].start < end);
 }
 
 /*
 ** Clone the given virtual space into a new one.
-** Returns NULL if the clone failed.
+** Only the page tables covering the binary or a region are visited.
+** Returns NULL if the clone failed, leaving the given one as it was.
 */
 struct vaspace *
 arch_clone_vaspace(struct vaspace *src)
 {
 	struct vaspace *vas;
-	void *kalloc_pd;
-	void *kalloc_pt;
 	struct page_dir *pd;
 	struct page_table *pt;
-	phys_addr_t pa;
+	phys_addr_t pd_pa;
+	phys_addr_t pt_pa;
+	uint64 start;
+	size_t nb_shared;
+	size_t vma;
 	size_t i;
 
-	vas = kalloc(sizeof(*vas));
-	kalloc_pd = kalloc(2 * sizeof(*pd)); /* Dirty way to have page-aligned allocations */
-	kalloc_pt = kalloc(2 * sizeof(*pt));
-	if (vas == NULL || kalloc_pd == NULL || kalloc_pt == NULL) {
-		kfree(vas);
-		kfree(kalloc_pd);
-		kfree(kalloc_pt);
+	start = rdtsc();
+	vas = kmem_cache_alloc(vaspace_cache);
+	pd_pa = alloc_frame();
+	if (vas == NULL || pd_pa == NULL_FRAME) {
+		if (vas != NULL) {
+			kmem_cache_free(vaspace_cache, vas);
+		}
+		if (pd_pa != NULL_FRAME) {
+			free_frame(pd_pa);
+		}
 		return (NULL);
 	}
 
 	/* Copy most of the virtual address space structure */
 	memcpy(vas, src, sizeof(*vas));
-
-	/* Set usable page directory and page table. */
-	pd = (struct page_dir *)ALIGN((uintptr)kalloc_pd, PAGE_SIZE);
-	pt = (struct page_table *)ALIGN((uintptr)kalloc_pt, PAGE_SIZE);
-
-	vas->arch.pagedir = get_paddr(pd);
+	vas->arch.pagedir = pd_pa;
 	vas->ref_count = 1;
 
-	pa = get_paddr(pt);
+	/* The new page directory and page tables are filled through the kmap window */
+	pd = kmap(pd_pa);
+	assert_neq(pd, NULL);
+	nb_shared = 0;
+	vma = 0;
+
+	LOCK_COW(state);
 
 	i = 0;
 	while (i < 1023)
 	{
 		pd->entries[i].value = GET_PAGE_DIRECTORY->entries[i].value;
 
-		/* Kernel page tables are linked together so we only care about user page tables */
+		/*
+		** Kernel page tables are linked together so we only care about user page tables,
+		** and only about those covering a region: the others were emptied by munmap().
+		*/
 		if (i < GET_PD_IDX(KERNEL_VIRTUAL_BASE)
-			&& GET_PAGE_DIRECTORY->entries[i].present)
+			&& GET_PAGE_DIRECTORY->entries[i].present
+			&& is_pde_in_use(src, i, &vma))
 		{
-			/* Set the new page table frame */
-			pd->entries[i].frame = pa >> 12u;
-			clone_page_table(pt, GET_PAGE_TABLE(i), i);
-
-			/* Set a new frame address for the next page table */
-			pa = alloc_frame();
-			assert_neq(pa, NULL_FRAME);
-			set_paddr(pt, pa);
+			/* Large pages are shared copy-on-write like the others, so split them first */
+			if (GET_PAGE_DIRECTORY->entries[i].size) {
+				if (arch_split_large_page(GET_VADDR(i, 0)) != OK) {
+					goto err_ret;
+				}
+				pd->entries[i].value = GET_PAGE_DIRECTORY->entries[i].value;
+			}
+
+			pt_pa = alloc_frame();
+			if (pt_pa == NULL_FRAME) {
+				goto err_ret;
+			}
+			pd->entries[i].frame = pt_pa >> 12u;
+
+			pt = kmap(pt_pa);
+			assert_neq(pt, NULL);
+			nb_shared += clone_page_table(pt, GET_PAGE_TABLE(i));
+			kunmap(pt);
+		}
+		else if (i < GET_PD_IDX(KERNEL_VIRTUAL_BASE)) {
+			pd->entries[i].value = 0;
 		}
 		++i;
 	}
 
+	/* Flush the TLB, as some of our pages are now read-only */
+	flush_tlb();
+
 	/* Set up recursiv mapping */
 	pd->entries[1023].value = 0;
 	pd->entries[1023].present = true;
 	pd->entries[1023].rw = true;
-	pd->entries[1023].frame = get_paddr(pd) >> 12u;
-
-	/* Set a new frame address for the page directory */
-	pa = alloc_frame();
-	assert_neq(pa, NULL_FRAME);
-	set_paddr(pd, pa);
-	kfree(kalloc_pd);
-	kfree(kalloc_pt);
+	pd->entries[1023].frame = pd_pa >> 12u;
+	kunmap(pd);
+
+	++fork_stats.nb_forks;
+	fork_stats.pages_shared += nb_shared;
+	fork_stats.fork_time += rdtsc() - start;
+	RELEASE_COW(state);
 	return (vas);
+
+err_ret:
+	/* Release the page tables cloned so far, and give the source its pages back */
+	while (i > 0)
+	{
+		--i;
+		if (i < GET_PD_IDX(KERNEL_VIRTUAL_BASE) && pd->entries[i].present)
+		{
+			unclone_page_table(GET_PAGE_TABLE(i));
+			free_frame(pd->entries[i].frame << 12u);
+		}
+	}
+	flush_tlb();
+	RELEASE_COW(state);
+	kunmap(pd);
+	free_frame(pd_pa);
+	kmem_cache_free(vaspace_cache, vas);
+	return (NULL);
+}
+
+/*
+** Handles a write to the given address, if it belongs to a page shared copy-on-write.
+**
+** If the current virtual address space holds the last reference to the frame,
+** the page is simply made writable again. Otherwise, it is copied to a new frame
+** mapped through the kmap window.
+**
+** Returns false if the page isn't a copy-on-write one or if it couldn't be copied,
+** in which case the fault is a genuine one.
+*/
+bool
+handle_cow_fault(virt_addr_t va)
+{
+	struct pagedir_entry *pde;
+	struct pagetable_entry *pte;
+	virt_addr_t copy;
+	phys_addr_t old;
+	phys_addr_t new;
+
+	va = (virt_addr_t)ROUND_DOWN((uintptr)va, PAGE_SIZE);
+	pde = GET_PAGE_DIRECTORY->entries + GET_PD_IDX(va);
+	pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
+
+	LOCK_COW(state);
+	if (!pde->present || pde->size || !pte->present || !pte->cow) {
+		RELEASE_COW(state);
+		return (false);
+	}
+
+	old = pte->frame << 12u;
+	if (phys_to_page(old)->refcount == 1) {
+		++fork_stats.pages_reused;
+	} else {
+		new = alloc_frame();
+		if (new == NULL_FRAME) {
+			RELEASE_COW(state);
+			return (false);
+		}
+
+		copy = kmap(new);
+		assert_neq(copy, NULL);
+		memcpy(copy, va, PAGE_SIZE);
+		kunmap(copy);
+
+		pte->frame = new >> 12u;
+		put_page(old);
+		++fork_stats.pages_copied;
+	}
+	pte->cow = false;
+	pte->rw = true;
+	invlpg(va);
+	RELEASE_COW(state);
+	return (true);
+}
+
+/*
+** Fills the given structure with the fork statistics.
+*/
+void
+arch_get_fork_stats(struct fork_stats *stats)
+{
+	LOCK_COW(state);
+	memcpy(stats, &fork_stats, sizeof(*stats));
+	RELEASE_COW(state);
 }
 
 /*
@@ -145,7 +319,11 @@ arch_free_vaspace(void)
 	while (i < GET_PD_IDX(KERNEL_VIRTUAL_BASE))
 	{
 		pde = GET_PAGE_DIRECTORY->entries + i;
-		if (pde->present) {
+		if (pde->present && pde->size) {
+			pa = pde->frame << 12u;
+			free_frames(pa, ARCH_LARGE_PAGE_ORDER);
+		}
+		else if (pde->present) {
 			pa = pde->frame << 12u;
 			free_frame(pa);
 		}
@@ -161,9 +339,73 @@ arch_free_vaspace(void)
 void
 arch_free_zombie_thread(struct thread *t)
 {
-	kfree(t->arch.kernel_stack);
+	kmem_cache_free(kernel_stack_cache, t->arch.kernel_stack);
 	t->arch.kernel_stack = NULL;
 
 	free_frame(t->vaspace->arch.pagedir);
 }
 
+
+/*
+** Unit tests function
+*/
+
+static void
+cow_test(void)
+{
+	struct fork_stats old;
+	struct fork_stats stats;
+	struct pagetable_entry *pte;
+	phys_addr_t pa;
+	char *va;
+
+	arch_get_fork_stats(&old);
+	va = (char *)0xDEADB000;
+	assert_eq(mmap(va, PAGE_SIZE, MMAP_WRITE), va);
+	va[0] = 42;
+	va[1] = 43;
+	pa = get_paddr(va);
+	pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
+
+	/* Share the page with a fake second address space */
+	get_page(pa);
+	pte->rw = false;
+	pte->cow = true;
+	invlpg(va);
+
+	/* The first write copies it */
+	va[0] = 44;
+	assert(pte->rw);
+	assert(!pte->cow);
+	assert_neq(get_paddr(va), pa);
+	assert_eq(va[0], 44);
+	assert_eq(va[1], 43);
+	assert_eq(phys_to_page(pa)->refcount, 1);
+	assert_eq(phys_to_page(get_paddr(va))->refcount, 1);
+	put_page(pa);
+
+	/* The last reference is made writable again */
+	pa = get_paddr(va);
+	pte->rw = false;
+	pte->cow = true;
+	invlpg(va);
+	va[1] = 45;
+	assert(pte->rw);
+	assert(!pte->cow);
+	assert_eq(get_paddr(va), pa);
+	assert_eq(va[0], 44);
+	assert_eq(va[1], 45);
+
+	/* Read-only pages that aren't shared still fault */
+	pte->rw = false;
+	invlpg(va);
+	assert(!handle_cow_fault(va));
+	munmap(va, PAGE_SIZE);
+	assert(!handle_cow_fault(va));
+
+	arch_get_fork_stats(&stats);
+	assert_eq(stats.pages_copied, old.pages_copied + 1);
+	assert_eq(stats.pages_reused, old.pages_reused + 1);
+}
+
+NEW_UNIT_TEST(cow, &cow_test, UNIT_TEST_LEVEL_VMM);
@@ -10,24 +10,49 @@
 #include <kernel/unit-tests.h>
 #include <kernel/kalloc.h>
 #include <kernel/multiboot.h>
+#include <kernel/zero_pool.h>
+#include <kernel/thread.h>
+#include <kernel/interrupts.h>
 #include <arch/x86/vmm.h>
 #include <arch/x86/asm.h>
 #include <stdio.h>
 #include <string.h>
 
-status_t
-arch_map_virt_to_phys(virt_addr_t va, phys_addr_t pa, mmap_flags_t flags)
+/* The page table mapping the kernel, replacing the large page used at boot */
+static struct page_table kernel_page_table __aligned(PAGE_SIZE);
+
+/*
+** Sets the flags of a new page table entry.
+** Kernel pages are the same in all virtual address spaces, so they are made
+** global: they stay in the TLB when switching to an other one.
+*/
+static void
+set_pte_flags(struct pagetable_entry *pte, virt_addr_t va, mmap_flags_t flags)
+{
+	pte->rw = (bool)(flags & MMAP_WRITE);
+	pte->user = (bool)(flags & MMAP_USER);
+	pte->global = (GET_PD_IDX(va) >= GET_PD_IDX(KERNEL_VIRTUAL_BASE));
+}
+
+/*
+** Makes sure the page table covering the given virtual address is present,
+** allocating it if needed. 'allocated', if not NULL, is set if it had to.
+** Fails if the given virtual address is mapped by a large page.
+*/
+static status_t
+get_page_table(virt_addr_t va, mmap_flags_t flags, bool *allocated)
 {
 	struct pagedir_entry *pde;
-	struct pagetable_entry *pte;
 	struct page_table *pt;
-	bool allocated_pde;
 
-	allocated_pde = false;
-	assert(IS_PAGE_ALIGNED(va));
-	assert(IS_PAGE_ALIGNED(pa));
+	if (allocated) {
+		*allocated = false;
+	}
 	pde = GET_PAGE_DIRECTORY->entries + GET_PD_IDX(va);
 	pt = GET_PAGE_TABLE(GET_PD_IDX(va));
+	if (pde->present && pde->size) {
+		return (ERR_ALREADY_MAPPED);
+	}
 	if (pde->present == false)
 	{
 		pde->value = alloc_frame();
@@ -40,46 +65,472 @@ arch_map_virt_to_phys(virt_addr_t va, phys_addr_t pa, mmap_flags_t flags)
 		pde->user = (bool)(flags & MMAP_USER);
 		invlpg(pt);
 		memset(pt, 0, PAGE_SIZE);
-		allocated_pde = true;
+		if (allocated) {
+			*allocated = true;
+		}
 	}
+	return (OK);
+}
+
+/*
+** Frees the page tables whose index is set in the given bitmap, that a mapping
+** allocated before it failed, once it rolled back the entries it had filled.
+** The page tables that were there before are kept, even if they are empty.
+*/
+static void
+free_page_tables(uint32 const *allocated)
+{
+	struct pagedir_entry *pde;
+	size_t pidx;
+	uint32 word;
+	size_t i;
+
+	i = 0;
+	while (i < PD_BITMAP_SIZE)
+	{
+		word = allocated[i];
+		while (word)
+		{
+			pidx = i * 32u + __builtin_ctz(word);
+			word &= word - 1u;
+			pde = GET_PAGE_DIRECTORY->entries + pidx;
+			assert(pde->present && !pde->size);
+			free_frame(pde->frame << 12u);
+			pde->value = 0;
+			invlpg(GET_PAGE_TABLE(pidx));
+		}
+		++i;
+	}
+}
+
+/*
+** Finds the page table entry of the given virtual address, allocating the page
+** table holding it if needed.
+** Fails if the given virtual address is already mapped or reserved.
+*/
+static status_t
+get_free_pte(virt_addr_t va, mmap_flags_t flags, struct pagetable_entry **ppte)
+{
+	struct pagetable_entry *pte;
+	struct page_table *pt;
+	bool allocated_pde;
+	status_t s;
+
+	assert(IS_PAGE_ALIGNED(va));
+	s = get_page_table(va, flags, &allocated_pde);
+	if (s != OK) {
+		return (s);
+	}
+	pt = GET_PAGE_TABLE(GET_PD_IDX(va));
 	pte = pt->entries + GET_PT_IDX(va);
 	/* Return NULL if the page is already mapped */
-	if (pte->present)
+	if (pte->present || pte->lazy)
 	{
 		if (allocated_pde) {
 			munmap(pt, PAGE_SIZE);
 		}
 		return (ERR_ALREADY_MAPPED);
 	}
+	*ppte = pte;
+	return (OK);
+}
+
+/*
+** Maps a large page at the given virtual address, which must be in user space.
+** Kernel page directory entries are copied in each virtual address space, so
+** they must never be replaced.
+*/
+static status_t
+map_large_virt_to_phys(virt_addr_t va, phys_addr_t pa, mmap_flags_t flags)
+{
+	struct pagedir_entry *pde;
+
+	if (!IS_LARGE_PAGE_ALIGNED(va) || !IS_LARGE_PAGE_ALIGNED(pa)
+		|| GET_PD_IDX(va) >= GET_PD_IDX(KERNEL_VIRTUAL_BASE)) {
+		return (ERR_INVALID_ARGS);
+	}
+	pde = GET_PAGE_DIRECTORY->entries + GET_PD_IDX(va);
+	if (pde->present) {
+		return (ERR_ALREADY_MAPPED);
+	}
+	pde->value = pa;
+	pde->present = true;
+	pde->rw = (bool)(flags & MMAP_WRITE);
+	pde->user = (bool)(flags & MMAP_USER);
+	pde->size = true;
+	invlpg(va);
+	return (OK);
+}
+
+/*
+** Splits the large page of the given page directory entry into regular pages,
+** using the given frame as their page table.
+*/
+static void
+split_large_page(size_t pidx, phys_addr_t pt_frame)
+{
+	struct pagedir_entry *pde;
+	struct pagedir_entry large;
+	struct pagetable_entry *pte;
+	int_state_t state;
+	size_t i;
+
+	pde = GET_PAGE_DIRECTORY->entries + pidx;
+	assert(pde->present && pde->size);
+
+	/* The page table is garbage until it's filled, no one must walk it meanwhile */
+	arch_push_interrupts(&state);
+	arch_disable_interrupts();
+	large.value = pde->value;
+	pde->value = pt_frame;
+	pde->present = true;
+	pde->rw = true;
+	pde->user = large.user;
+	flush_tlb();
+
+	i = 0;
+	while (i < 1024)
+	{
+		pte = GET_PAGE_TABLE(pidx)->entries + i;
+		pte->value = (large.frame << 12u) + i * PAGE_SIZE;
+		pte->present = true;
+		pte->rw = large.rw;
+		pte->user = large.user;
+		++i;
+	}
+	flush_tlb();
+	arch_pop_interrupts(&state);
+}
+
+/*
+** Splits the large page containing the given virtual address into regular pages,
+** using a new frame as their page table.
+*/
+status_t
+arch_split_large_page(virt_addr_t va)
+{
+	phys_addr_t pa;
+
+	pa = alloc_frame();
+	if (pa == NULL_FRAME) {
+		return (ERR_NO_MEMORY);
+	}
+	split_large_page(GET_PD_IDX(va), pa);
+	return (OK);
+}
+
+status_t
+arch_map_virt_to_phys(virt_addr_t va, phys_addr_t pa, mmap_flags_t flags)
+{
+	struct pagetable_entry *pte;
+	status_t s;
+
+	if (flags & MMAP_LARGE) {
+		return (map_large_virt_to_phys(va, pa, flags));
+	}
+	assert(IS_PAGE_ALIGNED(pa));
+	s = get_free_pte(va, flags, &pte);
+	if (s != OK) {
+		return (s);
+	}
 	pte->value = pa;
 	pte->present = true;
-	pte->rw = (bool)(flags & MMAP_WRITE);
-	pte->user = (bool)(flags & MMAP_USER);
+	set_pte_flags(pte, va, flags);
 	pte->accessed = false;
 	pte->dirty = 0;
 	invlpg(va);
 	return (OK);
 }
 
+/*
+** Fills the page table entry of the given virtual address with a new frame, that
+** is cleaned if it doesn't come from the pool.
+*/
+static status_t
+back_page(struct pagetable_entry *pte, virt_addr_t va)
+{
+	phys_addr_t pa;
+	bool zeroed;
+	bool rw;
+
+	pa = zero_pool_get();
+	zeroed = (pa != NULL_FRAME);
+	if (!zeroed) {
+		pa = alloc_frame();
+		if (pa == NULL_FRAME) {
+			return (ERR_NO_MEMORY);
+		}
+	}
+
+	/* The page is mapped writable to be cleaned, as the kernel can't write to read-only pages */
+	rw = pte->rw;
+	pte->frame = pa >> 12u;
+	pte->present = true;
+	pte->rw = true;
+	pte->lazy = false;
+	pte->accessed = false;
+	pte->dirty = 0;
+	invlpg(va);
+	if (!zeroed) {
+		memset(va, NEW_PAGE_FILL, PAGE_SIZE);
+	}
+	if (!rw) {
+		pte->rw = false;
+		invlpg(va);
+	}
+	return (OK);
+}
+
+/*
+** Maps a large page at the given virtual address, backed by a block of the zero pool.
+** Fails with ERR_NO_MEMORY if no block is ready: clearing one here would keep
+** interrupts disabled for far too long.
+*/
+static status_t
+map_large_page(virt_addr_t va, mmap_flags_t flags)
+{
+	phys_addr_t pa;
+	status_t s;
+
+	pa = zero_pool_get_large();
+	if (pa == NULL_FRAME) {
+		return (ERR_NO_MEMORY);
+	}
+	s = map_large_virt_to_phys(va, pa, flags);
+	if (s != OK) {
+		free_frames(pa, ARCH_LARGE_PAGE_ORDER);
+	}
+	return (s);
+}
+
 status_t
 arch_map_page(virt_addr_t va, mmap_flags_t flags)
 {
-	phys_addr_t pa;
+	struct pagetable_entry *pte;
 	status_t s;
 
-	pa = alloc_frame();
-	if (pa != NULL_FRAME)
+	if (flags & MMAP_LARGE) {
+		return (map_large_page(va, flags));
+	}
+	s = get_free_pte(va, flags, &pte);
+	if (s == OK)
+	{
+		pte->value = 0;
+		set_pte_flags(pte, va, flags);
+		s = back_page(pte, va);
+	}
+	return (s);
+}
+
+/*
+** Reserves the given virtual address: its page table entry is filled, but the page
+** is only backed by a frame when it is first accessed.
+*/
+status_t
+arch_reserve_page(virt_addr_t va, mmap_flags_t flags)
+{
+	struct pagetable_entry *pte;
+	status_t s;
+
+	s = get_free_pte(va, flags, &pte);
+	if (s == OK)
 	{
-		s = arch_map_virt_to_phys(va, pa, flags);
-		if (s == OK) {
-			/* Clean the new page with random shitty values */
-			memset(va, 42, PAGE_SIZE);
-			return (OK);
+		pte->value = 0;
+		pte->lazy = true;
+		set_pte_flags(pte, va, flags);
+	}
+	return (s);
+}
+
+/*
+** Maps 'size' bytes of virtual addresses starting at 'va', filling the entries
+** of each page table in a single loop.
+** They are mapped to the physical addresses starting at 'pa', or to new frames if
+** 'pa' is NULL_FRAME (or only reserved, with MMAP_LAZY). In the latter case, whole
+** page directory entries of user space are mapped by a large page if the zero pool
+** has a block ready.
+**
+** The number of bytes mapped is stored in 'done', even if it fails, and the
+** page tables allocated on the way are recorded in the bitmap 'allocated'.
+*/
+static status_t
+map_range(virt_addr_t va, phys_addr_t pa, size_t size, mmap_flags_t flags, size_t *done, uint32 *allocated)
+{
+	struct pagetable_entry *pte;
+	struct pagetable_entry *end;
+	size_t chunk;
+	bool new_pt;
+	status_t s;
+
+	assert(IS_PAGE_ALIGNED(va));
+	assert(IS_PAGE_ALIGNED(size));
+	*done = 0;
+	memset(allocated, 0, PD_BITMAP_SIZE * sizeof(*allocated));
+	while (*done < size)
+	{
+		chunk = MIN(size - *done, ARCH_LARGE_PAGE_SIZE - ((uintptr)va & (ARCH_LARGE_PAGE_SIZE - 1u)));
+		if (pa == NULL_FRAME && !(flags & MMAP_LAZY) && chunk == ARCH_LARGE_PAGE_SIZE
+			&& GET_PD_IDX(va) < GET_PD_IDX(KERNEL_VIRTUAL_BASE)
+			&& !GET_PAGE_DIRECTORY->entries[GET_PD_IDX(va)].present
+			&& map_large_page(va, flags) == OK)
+		{
+			va += chunk;
+			*done += chunk;
+			continue;
 		}
-		free_frame(pa);
-		return (s);
+
+		s = get_page_table(va, flags, &new_pt);
+		if (s != OK) {
+			return (s);
+		}
+		if (new_pt) {
+			allocated[GET_PD_IDX(va) / 32u] |= 1u << (GET_PD_IDX(va) % 32u);
+		}
+
+		/* The entries were not present, so none of them can be in the TLB */
+		pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
+		end = pte + chunk / PAGE_SIZE;
+		while (pte < end)
+		{
+			if (pte->present || pte->lazy) {
+				return (ERR_ALREADY_MAPPED);
+			}
+			pte->value = 0;
+			set_pte_flags(pte, va, flags);
+			if (flags & MMAP_LAZY) {
+				pte->lazy = true;
+			} else if (pa != NULL_FRAME) {
+				pte->frame = (pa + *done) >> 12u;
+				pte->present = true;
+			} else {
+				s = back_page(pte, va);
+				if (s != OK) {
+					pte->value = 0;
+					return (s);
+				}
+			}
+			++pte;
+			va += PAGE_SIZE;
+			*done += PAGE_SIZE;
+		}
+	}
+	return (OK);
+}
+
+/*
+** Maps 'size' bytes of contiguous virtual addresses to new frames, or only
+** reserves them if MMAP_LAZY is given.
+** Nothing is left mapped if it fails, and the page tables it allocated are freed.
+*/
+status_t
+arch_map_range(virt_addr_t va, size_t size, mmap_flags_t flags)
+{
+	uint32 allocated[PD_BITMAP_SIZE];
+	size_t done;
+	status_t s;
+
+	s = map_range(va, NULL_FRAME, size, flags, &done, allocated);
+	if (s != OK) {
+		arch_munmap_range(va, done);
+		free_page_tables(allocated);
+	}
+	return (s);
+}
+
+/*
+** Maps 'size' bytes of contiguous virtual addresses to the contiguous
+** physical addresses starting at 'pa', which aren't owned by the mapping.
+** Nothing is left mapped if it fails, and the page tables it allocated are freed.
+*/
+status_t
+arch_map_phys_range(virt_addr_t va, phys_addr_t pa, size_t size, mmap_flags_t flags)
+{
+	struct pagetable_entry *pte;
+	uint32 allocated[PD_BITMAP_SIZE];
+	size_t done;
+	size_t i;
+	status_t s;
+
+	assert(IS_PAGE_ALIGNED(pa));
+	s = map_range(va, pa, size, flags & ~MMAP_LAZY, &done, allocated);
+	if (s != OK)
+	{
+		i = 0;
+		while (i < done)
+		{
+			pte = GET_PAGE_TABLE(GET_PD_IDX(va + i))->entries + GET_PT_IDX(va + i);
+			pte->value = 0;
+			invlpg(va + i);
+			i += PAGE_SIZE;
+		}
+		free_page_tables(allocated);
 	}
-	return (ERR_NO_MEMORY);
+	return (s);
+}
+
+/*
+** Returns the page table entry of the given virtual address if it is reserved,
+** or NULL.
+*/
+static struct pagetable_entry *
+get_reserved_pte(virt_addr_t va)
+{
+	struct pagedir_entry *pde;
+	struct pagetable_entry *pte;
+
+	pde = GET_PAGE_DIRECTORY->entries + GET_PD_IDX(va);
+	if (!pde->present || pde->size) {
+		return (NULL);
+	}
+	pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
+	return (pte->lazy ? pte : NULL);
+}
+
+/*
+** Handles an access to the given address, if it belongs to a reserved page.
+**
+** The page is backed by a new frame. If one of its neighbours is already backed,
+** the memory is likely accessed sequentially, so the next FAULT_AROUND_PAGES
+** reserved pages in the same direction are backed too, saving a fault each.
+**
+** Returns false if the page isn't a reserved one or if there's no memory left,
+** in which case the fault is a genuine one.
+*/
+bool
+handle_lazy_fault(virt_addr_t va)
+{
+	struct pagetable_entry *pte;
+	intptr step;
+	size_t i;
+
+	va = (virt_addr_t)ROUND_DOWN((uintptr)va, PAGE_SIZE);
+
+	LOCK_VASPACE(state);
+	pte = get_reserved_pte(va);
+	if (pte == NULL || back_page(pte, va) != OK) {
+		RELEASE_VASPACE(state);
+		return (false);
+	}
+
+	step = 0;
+	if (va >= (virt_addr_t)PAGE_SIZE && get_paddr(va - PAGE_SIZE) != NULL_FRAME) {
+		step = PAGE_SIZE;
+	} else if (get_paddr(va + PAGE_SIZE) != NULL_FRAME) {
+		step = -PAGE_SIZE;
+	}
+
+	i = 0;
+	while (step && i < FAULT_AROUND_PAGES)
+	{
+		va += step;
+		pte = get_reserved_pte(va);
+		if (pte == NULL || back_page(pte, va) != OK) {
+			break;
+		}
+		++i;
+	}
+	RELEASE_VASPACE(state);
+	return (true);
 }
 
 void
@@ -90,12 +541,173 @@ arch_munmap_va(virt_addr_t va)
 
 	pde = GET_PAGE_DIRECTORY->entries + GET_PD_IDX(va);
 	pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
+
+	/* Split large pages, the frame that is unmapped becoming their page table */
+	if (pde->present && pde->size)
+	{
+		split_large_page(GET_PD_IDX(va), get_paddr(va));
+		pte->value = 0;
+		invlpg(va);
+		return ;
+	}
 	if (pde->present && pte->present)
 	{
 		free_frame(pte->frame << 12u);
 		pte->value = 0;
 		invlpg(va);
 	}
+	else if (pde->present && pte->lazy) {
+		pte->value = 0;
+	}
+}
+
+/*
+** Unmaps 'size' bytes of virtual addresses, starting at va.
+**
+** Page tables are walked once per page directory entry, and the ones that aren't
+** present are skipped. The first TLB_FLUSH_THRESHOLD pages unmapped are invalidated
+** on their own, but if there are more the whole TLB is flushed once at the end.
+*/
+void
+arch_munmap_range(virt_addr_t va, size_t size)
+{
+	struct pagedir_entry *pde;
+	struct pagetable_entry *pte;
+	size_t nb_unmapped;
+	size_t chunk;
+	bool global;
+
+	nb_unmapped = 0;
+	global = false;
+	while (size)
+	{
+		pde = GET_PAGE_DIRECTORY->entries + GET_PD_IDX(va);
+		chunk = MIN(size, ARCH_LARGE_PAGE_SIZE - ((uintptr)va & (ARCH_LARGE_PAGE_SIZE - 1u)));
+
+		/* Large pages are released at once, or split if they are partially unmapped */
+		if (pde->present && pde->size)
+		{
+			if (chunk < ARCH_LARGE_PAGE_SIZE)
+			{
+				arch_munmap_va(va);
+				va += PAGE_SIZE;
+				size -= PAGE_SIZE;
+				continue;
+			}
+			free_frames(pde->frame << 12u, ARCH_LARGE_PAGE_ORDER);
+			pde->value = 0;
+			if (++nb_unmapped <= TLB_FLUSH_THRESHOLD) {
+				invlpg(va);
+			}
+		}
+		else if (pde->present)
+		{
+			pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
+			while (chunk)
+			{
+				if (pte->present)
+				{
+					free_frame(pte->frame << 12u);
+					global |= pte->global;
+					pte->value = 0;
+					if (++nb_unmapped <= TLB_FLUSH_THRESHOLD) {
+						invlpg(va);
+					}
+				}
+				else if (pte->lazy) {
+					pte->value = 0;
+				}
+				++pte;
+				va += PAGE_SIZE;
+				size -= PAGE_SIZE;
+				chunk -= PAGE_SIZE;
+			}
+			continue;
+		}
+		va += chunk;
+		size -= chunk;
+	}
+
+	if (nb_unmapped > TLB_FLUSH_THRESHOLD) {
+		if (global) {
+			flush_tlb_global();
+		} else {
+			flush_tlb();
+		}
+	}
+}
+
+static struct spinlock	kmap_lock;
+static uint32		kmap_used;	/* One bit per slot of the kmap window */
+
+/*
+** Maps the given frame on a free slot of the kmap window, so that it can be
+** read or written even if it isn't mapped in the current virtual address space.
+** The slot is kept until kunmap() is called.
+**
+** Returns the virtual address of the frame, or NULL if all slots are in use.
+*/
+virt_addr_t
+kmap(phys_addr_t pa)
+{
+	struct pagetable_entry *pte;
+	virt_addr_t va;
+	uint i;
+
+	assert(IS_PAGE_ALIGNED(pa));
+
+	LOCK(&kmap_lock, state);
+	if (kmap_used == (uint32)((1ull << KMAP_SLOTS) - 1u)) {
+		RELEASE(&kmap_lock, state);
+		return (NULL);
+	}
+	i = __builtin_ctz(~kmap_used);
+	kmap_used |= 1u << i;
+	RELEASE(&kmap_lock, state);
+
+	/* The slot was invalidated when it was released, so there is nothing to flush */
+	va = KMAP_WINDOW + i * PAGE_SIZE;
+	pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
+	pte->value = pa;
+	pte->present = true;
+	pte->rw = true;
+	pte->global = true;
+	return (va);
+}
+
+/*
+** Releases a slot of the kmap window given by kmap().
+*/
+void
+kunmap(virt_addr_t va)
+{
+	struct pagetable_entry *pte;
+	uint i;
+
+	assert(va >= KMAP_WINDOW && va < KMAP_WINDOW + KMAP_SLOTS * PAGE_SIZE);
+	i = (va - KMAP_WINDOW) / PAGE_SIZE;
+	pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
+	pte->value = 0;
+	invlpg(va);
+
+	LOCK(&kmap_lock, state);
+	assert(kmap_used & (1u << i));
+	kmap_used &= ~(1u << i);
+	RELEASE(&kmap_lock, state);
+}
+
+/*
+** Fills the given frame with zeroes.
+*/
+void
+arch_zero_frame(phys_addr_t pa)
+{
+	virt_addr_t va;
+
+	va = kmap(pa);
+	assert_neq(va, NULL);
+	memset(va, 0, PAGE_SIZE);
+	kunmap(va);
 }
 
 /*
@@ -110,6 +722,9 @@ get_paddr(virt_addr_t va)
 
 	pde = GET_PAGE_DIRECTORY->entries + GET_PD_IDX(va);
 	pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
+	if (pde->present && pde->size) {
+		return ((pde->frame << 12u) + (GET_PT_IDX(va) << 12u));
+	}
 	if (pde->present && pte->present) {
 		return (pte->frame << 12u);
 	}
@@ -131,6 +746,9 @@ set_paddr(virt_addr_t va, phys_addr_t pa)
 
 	pde = GET_PAGE_DIRECTORY->entries + GET_PD_IDX(va);
 	pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
+	if (pde->present && pde->size && arch_split_large_page(va) != OK) {
+		return (NULL_FRAME);
+	}
 	if (pde->present && pte->present) {
 		old = pte->frame << 12u;
 		pte->frame = pa >> 12u;
@@ -147,48 +765,73 @@ void
 arch_vmm_mark_initrd(void)
 {
 	void *initrd;
-	size_t i;
 
 	/* Allocate the initrd */
 	if (multiboot_infos.initrd.present) {
 
-		/* Page alignment tricks (TODO add a page-aligned alocator */
-		initrd = kalloc(multiboot_infos.initrd.size + 2 * PAGE_SIZE);
-		assert_neq(initrd, NULL);
-
-		/* We don't give a shit about losing the pointer, we will never kfree() it.*/
-		initrd = (void *)ALIGN((uintptr)initrd, PAGE_SIZE);
-
-		i = 0;
-		while (i < multiboot_infos.initrd.size) {
-			free_frame(get_paddr(initrd + i));
-			set_paddr(initrd + i, multiboot_infos.initrd.pstart + i);
-			i += PAGE_SIZE;
+		/* It may already be mapped along with the kernel */
+		if (multiboot_infos.initrd.pstart + multiboot_infos.initrd.size <= ARCH_BOOT_MAPPING_SIZE) {
+			initrd = (uchar *)KERNEL_VIRTUAL_BASE + multiboot_infos.initrd.pstart;
+		}
+		else {
+			initrd = map_kpages(multiboot_infos.initrd.pstart, multiboot_infos.initrd.size);
+			assert_neq(initrd, NULL);
 		}
 		multiboot_infos.initrd.vstart = initrd;
 		multiboot_infos.initrd.vend = initrd + multiboot_infos.initrd.size;
 	}
 }
 
+/*
+** Tells if the given frame, mapped at boot, holds the initrd or the multiboot
+** structure. Both are reserved by the PMM, and used through that mapping.
+*/
+static bool
+is_boot_module(phys_addr_t pa)
+{
+	if (multiboot_infos.initrd.present
+		&& pa >= multiboot_infos.initrd.pstart && pa <= multiboot_infos.initrd.pend) {
+		return (true);
+	}
+	return (pa >= ROUND_DOWN(multiboot_infos.pstart, PAGE_SIZE) && pa < multiboot_infos.pend);
+}
+
 void
 arch_vmm_init(void)
 {
-	size_t i;
-	size_t j;
+	struct pagedir_entry *pde;
+	struct pagetable_entry *pte;
 	phys_addr_t pa;
+	size_t i;
 	status_t s;
 
-	/* Remove the top part of identity mapping */
-	i = GET_PD_IDX(KERNEL_VIRTUAL_END);
-	j = GET_PT_IDX(KERNEL_VIRTUAL_END) + 1;
-	while (j < 1024)
+	/*
+	** The large page mapping the kernel at boot also maps frames that the PMM
+	** hands out. Replace it by a page table mapping only what is reserved at boot,
+	** so that those frames can't be reached through a stale kernel pointer.
+	** The page table is filled before it is used, as the kernel runs from there.
+	*/
+	pde = GET_PAGE_DIRECTORY->entries + GET_PD_IDX(KERNEL_VIRTUAL_BASE);
+	assert(pde->present && pde->size);
+	assert(boot_memory_end < ARCH_BOOT_MAPPING_SIZE);
+	i = 0;
+	while (i < 1024)
 	{
-		pa = GET_PAGE_TABLE(i)->entries[j].frame << 12u;
-		assert(pa > KERNEL_PHYSICAL_END);
-
-		GET_PAGE_TABLE(i)->entries[j].value = 0;
-		++j;
+		pa = i * PAGE_SIZE;
+		if (pa <= boot_memory_end || is_boot_module(pa))
+		{
+			pte = kernel_page_table.entries + i;
+			pte->value = pa;
+			pte->present = true;
+			pte->rw = true;
+			pte->global = true;
+		}
+		++i;
 	}
+	pde->value = (uintptr)&kernel_page_table - (uintptr)KERNEL_VIRTUAL_BASE;
+	pde->present = true;
+	pde->rw = true;
+	flush_tlb_global();
 
 	/* Allocates all kernel page tables, so that each future processes share kernel memory. */
 	i = GET_PD_IDX(KERNEL_VIRTUAL_BASE);
@@ -222,7 +865,7 @@ arch_dump_mem(void)
 	{
 		if (pd->entries[i].present)
 		{
-			printf("[%4u] [%#p -> %#p] %s %c %c %c %c %c\n",
+			printf("[%4u] [%#p -> %#p] %s %c %c %c %c %c %c\n",
 				i,
 				i << 22u,
 				pd->entries[i].frame << 12ul,
@@ -231,7 +874,8 @@ arch_dump_mem(void)
 				"-w"[pd->entries[i].wtrough],
 				"-d"[pd->entries[i].cache],
 				"-a"[pd->entries[i].accessed],
-				"-H"[pd->entries[i].size]);
+				"-H"[pd->entries[i].size],
+				"-g"[pd->entries[i].size && pd->entries[i].global]);
 			if (pd->entries[i].size == false && i != 1023)
 			{
 				pt = GET_PAGE_TABLE(i);
@@ -240,7 +884,7 @@ arch_dump_mem(void)
 				{
 					if (pt->entries[j].present)
 					{
-						printf("\t[%4u] [%#p -> %#p] %s %c %c %c %c %c\n",
+						printf("\t[%4u] [%#p -> %#p] %s %c %c %c %c %c %c\n",
 							j,
 							(i << 22u) | (j << 12u),
 							pt->entries[j].frame << 12ul,
@@ -249,7 +893,8 @@ arch_dump_mem(void)
 							"-w"[pt->entries[j].wtrough],
 							"-d"[pt->entries[j].cache],
 							"-a"[pt->entries[j].accessed],
-							"-d"[pt->entries[j].dirty]);
+							"-d"[pt->entries[j].dirty],
+							"-g"[pt->entries[j].global]);
 					}
 					++j;
 				}
@@ -268,7 +913,7 @@ arch_is_allocated(virt_addr_t va)
 	assert(IS_PAGE_ALIGNED(va));
 	pde = GET_PAGE_DIRECTORY->entries + GET_PD_IDX(va);
 	pte = GET_PAGE_TABLE(GET_PD_IDX(va))->entries + GET_PT_IDX(va);
-	return (pde->present && pte->present);
+	return (pde->present && (pde->size || pte->present));
 }
 
 static void
@@ -281,11 +926,11 @@ vmm_test(void)
 	extern size_t kernel_heap_size;
 
 	assert(!arch_is_allocated((virt_addr_t)0xDEADB000));
-	assert_eq(arch_map_page((virt_addr_t)0xDEADB000, MMAP_DEFAULT), OK);
+	assert_eq(arch_map_page((virt_addr_t)0xDEADB000, MMAP_WRITE), OK);
 	assert(arch_is_allocated((virt_addr_t)0xDEADB000));
 	assert(!arch_is_allocated((virt_addr_t)0xDEADA000));
 	assert(!arch_is_allocated((virt_addr_t)0xDEADC000));
-	assert_eq(*(char *)0xDEADB000, 42);
+	assert_eq(*(char *)0xDEADB000, NEW_PAGE_FILL);
 	*(char *)0xDEADB000 = 43;
 	assert_eq(*(char *)0xDEADB000, 43);
 	assert_eq(arch_map_page((virt_addr_t)0xDEADB000, MMAP_DEFAULT), ERR_ALREADY_MAPPED);
@@ -377,3 +1022,339 @@ vmm_test(void)
 }
 
 NEW_UNIT_TEST(vmm, &vmm_test, UNIT_TEST_LEVEL_VMM);
+
+static void
+lazy_test(void)
+{
+	size_t free;
+	size_t i;
+
+	/* Reserving pages doesn't take any frame */
+	assert_eq(mmap((virt_addr_t)0xDEAD0000, PAGE_SIZE, MMAP_WRITE), (virt_addr_t)0xDEAD0000);
+	free = nb_free_frames();
+	assert_eq(mmap((virt_addr_t)0xDEADA000, 6 * PAGE_SIZE + FAULT_AROUND_PAGES * PAGE_SIZE, MMAP_WRITE | MMAP_LAZY), (virt_addr_t)0xDEADA000);
+	assert_eq(nb_free_frames(), free);
+	assert(!arch_is_allocated((virt_addr_t)0xDEADA000));
+	assert_eq(mmap((virt_addr_t)0xDEADC000, PAGE_SIZE, MMAP_WRITE), NULL);
+	assert_eq(mmap((virt_addr_t)0xDEADC000, PAGE_SIZE, MMAP_WRITE | MMAP_LAZY), NULL);
+
+	/* An isolated access only backs the page touched */
+	assert_eq(*(uchar *)0xDEADC000, NEW_PAGE_FILL);
+	assert(arch_is_allocated((virt_addr_t)0xDEADC000));
+	assert(!arch_is_allocated((virt_addr_t)0xDEADB000));
+	assert(!arch_is_allocated((virt_addr_t)0xDEADD000));
+	*(uchar *)0xDEADC000 = 42;
+	assert_eq(*(uchar *)0xDEADC000, 42);
+
+	/* A sequential access backs the following pages too */
+	*(uchar *)0xDEADD000 = 43;
+	i = 0;
+	while (i <= FAULT_AROUND_PAGES)
+	{
+		assert(arch_is_allocated((virt_addr_t)0xDEADD000 + i * PAGE_SIZE));
+		++i;
+	}
+	assert(!arch_is_allocated((virt_addr_t)0xDEADD000 + i * PAGE_SIZE));
+
+	/* Even downward */
+	*(uchar *)0xDEADB000 = 44;
+	assert(arch_is_allocated((virt_addr_t)0xDEADB000));
+	assert(arch_is_allocated((virt_addr_t)0xDEADA000));
+	assert_eq(*(uchar *)0xDEADA000, NEW_PAGE_FILL);
+
+	/* Reserved pages that weren't touched are released too */
+	munmap((virt_addr_t)0xDEADA000, 6 * PAGE_SIZE + FAULT_AROUND_PAGES * PAGE_SIZE);
+	assert_eq(nb_free_frames(), free);
+	assert_eq(mmap((virt_addr_t)0xDEADA000, 6 * PAGE_SIZE + FAULT_AROUND_PAGES * PAGE_SIZE, MMAP_WRITE), (virt_addr_t)0xDEADA000);
+	munmap((virt_addr_t)0xDEADA000, 6 * PAGE_SIZE + FAULT_AROUND_PAGES * PAGE_SIZE);
+	munmap((virt_addr_t)0xDEAD0000, PAGE_SIZE);
+}
+
+NEW_UNIT_TEST(lazy, &lazy_test, UNIT_TEST_LEVEL_VMM);
+
+static void
+large_test(void)
+{
+#ifndef ENABLE_PAGE_POISON
+	struct zero_pool_stats stats;
+	virt_addr_t va;
+	phys_addr_t pa;
+	size_t free;
+
+	/* Without a pre-zeroed block, regular pages are used, and one is prepared */
+	va = (virt_addr_t)0x81000000;
+	assert_eq(mmap(va, ARCH_LARGE_PAGE_SIZE, MMAP_WRITE), va);
+	assert(!GET_PAGE_DIRECTORY->entries[GET_PD_IDX(va)].size);
+	assert(arch_is_allocated(va + ARCH_LARGE_PAGE_SIZE - PAGE_SIZE));
+	munmap(va, ARCH_LARGE_PAGE_SIZE);
+	while (zero_pool_refill());
+	zero_pool_get_stats(&stats);
+	assert_eq(stats.nb_large, 1);
+
+	va = (virt_addr_t)0x80000000;
+	free = nb_free_frames();
+
+	/* Large pages are used where the alignment and the size allow it */
+	assert_eq(mmap(va, ARCH_LARGE_PAGE_SIZE + PAGE_SIZE, MMAP_WRITE), va);
+	assert(GET_PAGE_DIRECTORY->entries[GET_PD_IDX(va)].size);
+	assert(!GET_PAGE_DIRECTORY->entries[GET_PD_IDX(va + ARCH_LARGE_PAGE_SIZE)].size);
+	assert(arch_is_allocated(va + ARCH_LARGE_PAGE_SIZE - PAGE_SIZE));
+	assert(arch_is_allocated(va + ARCH_LARGE_PAGE_SIZE));
+	pa = get_paddr(va);
+	assert(IS_LARGE_PAGE_ALIGNED(pa));
+	assert_eq(get_paddr(va + 5 * PAGE_SIZE), pa + 5 * PAGE_SIZE);
+	assert_eq(*(char *)(va + 5 * PAGE_SIZE), NEW_PAGE_FILL);
+	*(char *)(va + 5 * PAGE_SIZE) = 42;
+	assert_eq(mmap(va + PAGE_SIZE, PAGE_SIZE, MMAP_WRITE), NULL);
+	assert_eq(arch_map_virt_to_phys((virt_addr_t)KERNEL_VIRTUAL_BASE, 0, MMAP_WRITE | MMAP_LARGE), ERR_INVALID_ARGS);
+
+	/* Unmapping a part of a large page splits it */
+	munmap(va, PAGE_SIZE);
+	assert(!GET_PAGE_DIRECTORY->entries[GET_PD_IDX(va)].size);
+	assert(!arch_is_allocated(va));
+	assert(arch_is_allocated(va + PAGE_SIZE));
+	assert_eq(get_paddr(va + 5 * PAGE_SIZE), pa + 5 * PAGE_SIZE);
+	assert_eq(*(char *)(va + 5 * PAGE_SIZE), 42);
+
+	/* The block and the last page came from the pool, only the two page tables are left */
+	munmap(va, ARCH_LARGE_PAGE_SIZE + PAGE_SIZE);
+	assert(!arch_is_allocated(va + PAGE_SIZE));
+	assert_eq(nb_free_frames(), free + (1 << ARCH_LARGE_PAGE_ORDER) + 1 - 2);
+
+	/* The block used isn't replaced */
+	zero_pool_get_stats(&stats);
+	assert_eq(stats.nb_large, 0);
+
+	/* Give the frames left in the pool back */
+	while ((pa = zero_pool_get()) != NULL_FRAME) {
+		free_frame(pa);
+	}
+#endif
+}
+
+NEW_UNIT_TEST(large, &large_test, UNIT_TEST_LEVEL_VMM);
+
+static void
+munmap_range_test(void)
+{
+	uchar *start;
+	uchar *end;
+	size_t free;
+
+	start = (uchar *)0x7FFFE000;
+	end = (uchar *)0x80C00000 + (TLB_FLUSH_THRESHOLD + 1) * PAGE_SIZE;
+
+	/* Pages spread over page tables, with holes and page tables that aren't present */
+	assert_eq(mmap(start, 4 * PAGE_SIZE, MMAP_WRITE), start);
+	assert_eq(mmap((uchar *)0x80800000, ARCH_LARGE_PAGE_SIZE, MMAP_WRITE), (uchar *)0x80800000);
+	assert_eq(mmap((uchar *)0x80C00000, (TLB_FLUSH_THRESHOLD + 1) * PAGE_SIZE, MMAP_WRITE), (uchar *)0x80C00000);
+	assert_eq(mmap(end, 2 * PAGE_SIZE, MMAP_WRITE | MMAP_LAZY), end);
+	free = nb_free_frames();
+
+	/* Enough pages to flush the whole TLB */
+	munmap(start, end + 2 * PAGE_SIZE - start);
+	assert(!arch_is_allocated(start));
+	assert(!arch_is_allocated(start + 3 * PAGE_SIZE));
+	assert(!arch_is_allocated((uchar *)0x80800000));
+	assert(!arch_is_allocated((uchar *)0x80C00000));
+	assert(!arch_is_allocated(end - PAGE_SIZE));
+	assert_eq(nb_free_frames(), free + 4 + (1 << ARCH_LARGE_PAGE_ORDER) + TLB_FLUSH_THRESHOLD + 1);
+	assert_eq(mmap(end, 2 * PAGE_SIZE, MMAP_WRITE | MMAP_LAZY), end);
+
+	/* Few enough pages to invalidate each of them */
+	assert_eq(mmap(start, 4 * PAGE_SIZE, MMAP_WRITE), start);
+	*(start + PAGE_SIZE) = 42;
+	munmap(start, 2 * PAGE_SIZE);
+	assert(!arch_is_allocated(start + PAGE_SIZE));
+	assert(arch_is_allocated(start + 2 * PAGE_SIZE));
+	munmap(start, end + 2 * PAGE_SIZE - start);
+	assert_eq(nb_free_frames(), free + 4 + (1 << ARCH_LARGE_PAGE_ORDER) + TLB_FLUSH_THRESHOLD + 1);
+}
+
+NEW_UNIT_TEST(munmap_range, &munmap_range_test, UNIT_TEST_LEVEL_VMM);
+
+static void
+kmap_test(void)
+{
+	virt_addr_t slots[KMAP_SLOTS];
+	phys_addr_t pa;
+	uchar *va;
+	uchar *kva;
+	size_t i;
+
+	va = (uchar *)0xDEAD0000;
+	assert_eq(mmap(va, PAGE_SIZE, MMAP_WRITE), va);
+	pa = get_paddr(va);
+
+	/* The frame is reached without its mapping */
+	kva = kmap(pa);
+	assert_neq(kva, NULL);
+	assert_eq(get_paddr(kva), pa);
+	kva[0] = 42;
+	assert_eq(va[0], 42);
+	kunmap(kva);
+	assert(!arch_is_allocated(kva));
+
+	/* Slots run out, and are given back */
+	i = 0;
+	while (i < KMAP_SLOTS)
+	{
+		slots[i] = kmap(pa);
+		assert_neq(slots[i], NULL);
+		++i;
+	}
+	assert_eq(kmap(pa), NULL);
+	while (i > 0) {
+		kunmap(slots[--i]);
+	}
+	kva = kmap(pa);
+	assert_eq(kva, KMAP_WINDOW);
+	kunmap(kva);
+
+	munmap(va, PAGE_SIZE);
+}
+
+NEW_UNIT_TEST(kmap, &kmap_test, UNIT_TEST_LEVEL_VMM);
+
+static void
+kpages_test(void)
+{
+	struct pmm_stats stats;
+	uchar *va;
+	uchar *va2;
+	size_t free;
+
+	/* Blocks are page-aligned and backed */
+	va = alloc_kpages(2);
+	assert_neq(va, NULL);
+	assert(IS_PAGE_ALIGNED(va));
+	assert(arch_is_allocated(va));
+	assert(arch_is_allocated(va + 3 * PAGE_SIZE));
+	va[4 * PAGE_SIZE - 1] = 42;
+	va2 = alloc_kpages(0);
+	assert_neq(va2, NULL);
+	assert(va2 >= va + 4 * PAGE_SIZE || va2 + PAGE_SIZE <= va);
+
+	/* Freed blocks give their frames back */
+	pmm_get_stats(&stats);
+	free = stats.nb_free;
+	free_kpages(va, 2);
+	free_kpages(va2, 0);
+	assert(!arch_is_allocated(va));
+	assert(!arch_is_allocated(va2));
+	pmm_get_stats(&stats);
+	assert_eq(stats.nb_free, free + 5);
+
+	/* Their addresses are reused, so they never run out */
+	va = alloc_kpages(2);
+	assert_neq(va, NULL);
+	free_kpages(va, 2);
+	assert_eq(alloc_kpages(2), va);
+	free_kpages(va, 2);
+	pmm_get_stats(&stats);
+	assert_eq(stats.nb_free, free + 5);
+}
+
+NEW_UNIT_TEST(kpages, &kpages_test, UNIT_TEST_LEVEL_VMM);
+
+static void
+vmalloc_test(void)
+{
+	uchar *va;
+	uchar *va2;
+	size_t free;
+
+	/* Areas are rounded up to a page and followed by a guard page */
+	free = nb_free_frames();
+	va = vmalloc(3 * PAGE_SIZE + 1);
+	assert_neq(va, NULL);
+	assert(is_vmalloc_addr(va));
+	assert(IS_PAGE_ALIGNED(va));
+	assert_eq(vmalloc_size(va), 4 * PAGE_SIZE);
+	assert(arch_is_allocated(va + 3 * PAGE_SIZE));
+	assert(!arch_is_allocated(va + 4 * PAGE_SIZE));
+	va[4 * PAGE_SIZE - 1] = 42;
+	va2 = vmalloc(PAGE_SIZE);
+	assert_neq(va2, NULL);
+	assert(va2 >= va + 5 * PAGE_SIZE || va2 + 2 * PAGE_SIZE <= va);
+
+	/* Freed areas are unmapped right away, and their addresses reused */
+	vfree(va);
+	assert(!arch_is_allocated(va));
+	assert(!arch_is_allocated(va + 3 * PAGE_SIZE));
+	assert_eq(vmalloc(3 * PAGE_SIZE + 1), va);
+	vfree(va);
+	vfree(va2);
+
+	/* Areas are resized in place, as long as a guard page is left after them */
+	va = vmalloc(8 * PAGE_SIZE);
+	va[PAGE_SIZE] = 42;
+	assert(vresize(va, 2 * PAGE_SIZE));
+	assert_eq(vmalloc_size(va), 2 * PAGE_SIZE);
+	assert(arch_is_allocated(va + PAGE_SIZE));
+	assert(!arch_is_allocated(va + 2 * PAGE_SIZE));
+	assert(vresize(va, 8 * PAGE_SIZE));
+	assert(arch_is_allocated(va + 7 * PAGE_SIZE));
+	assert_eq(va[PAGE_SIZE], 42);
+	assert(!vresize(va, (uchar *)ARCH_VMALLOC_END - va));
+	assert_eq(vmalloc_size(va), 8 * PAGE_SIZE);
+	vfree(va);
+	assert_eq(nb_free_frames(), free);
+}
+
+NEW_UNIT_TEST(vmalloc, &vmalloc_test, UNIT_TEST_LEVEL_VMM);
+
+static void
+map_range_test(void)
+{
+	uchar *va;
+	phys_addr_t pa;
+	size_t free;
+
+	/* Ranges spread over several page tables */
+	va = (uchar *)0x80400000 - 2 * PAGE_SIZE;
+	assert_eq(arch_map_range(va, 4 * PAGE_SIZE, MMAP_WRITE), OK);
+	assert(arch_is_allocated(va));
+	assert(arch_is_allocated(va + 3 * PAGE_SIZE));
+	assert_eq(*(va + 3 * PAGE_SIZE), NEW_PAGE_FILL);
+	free = nb_free_frames();
+	arch_munmap_range(va, 4 * PAGE_SIZE);
+	assert_eq(nb_free_frames(), free + 4);
+
+	/* Nothing is left mapped when it fails, and the page tables that were there are kept */
+	assert_eq(arch_reserve_page(va + 2 * PAGE_SIZE, MMAP_WRITE), OK);
+	assert_eq(arch_map_range(va, 4 * PAGE_SIZE, MMAP_WRITE), ERR_ALREADY_MAPPED);
+	assert(!arch_is_allocated(va));
+	assert(!arch_is_allocated(va + PAGE_SIZE));
+	assert(GET_PAGE_DIRECTORY->entries[GET_PD_IDX(va)].present);
+	assert(GET_PAGE_DIRECTORY->entries[GET_PD_IDX(va + 2 * PAGE_SIZE)].present);
+	assert_eq(arch_map_range(va + 3 * PAGE_SIZE, PAGE_SIZE, MMAP_WRITE | MMAP_LAZY), OK);
+	assert(!arch_is_allocated(va + 3 * PAGE_SIZE));
+	assert_eq(nb_free_frames(), free + 4);
+	arch_munmap_range(va, 4 * PAGE_SIZE);
+
+	/* Physical ranges are mapped as they are */
+	pa = alloc_frames(1);
+	assert_neq(pa, NULL_FRAME);
+	assert_eq(arch_map_phys_range(va + PAGE_SIZE, pa, 2 * PAGE_SIZE, MMAP_WRITE), OK);
+	assert_eq(get_paddr(va + PAGE_SIZE), pa);
+	assert_eq(get_paddr(va + 2 * PAGE_SIZE), pa + PAGE_SIZE);
+	assert_eq(arch_map_phys_range(va, pa, 2 * PAGE_SIZE, MMAP_WRITE), ERR_ALREADY_MAPPED);
+	assert(!arch_is_allocated(va));
+	assert_eq(get_paddr(va + PAGE_SIZE), pa);
+
+	/* Unmapping them releases the frames */
+	arch_munmap_range(va, 4 * PAGE_SIZE);
+	assert_eq(nb_free_frames(), free + 4);
+
+	/* The page tables it allocated itself are freed too */
+	va = (uchar *)0x84400000;
+	assert_eq(arch_reserve_page(va, MMAP_WRITE), OK);
+	free = nb_free_frames();
+	assert_eq(arch_map_range(va - 2 * PAGE_SIZE, 3 * PAGE_SIZE, MMAP_WRITE), ERR_ALREADY_MAPPED);
+	assert(!GET_PAGE_DIRECTORY->entries[GET_PD_IDX(va - PAGE_SIZE)].present);
+	assert_eq(nb_free_frames(), free);
+	arch_munmap_range(va, PAGE_SIZE);
+}
+
+NEW_UNIT_TEST(map_range, &map_range_test, UNIT_TEST_LEVEL_VMM);
@@ -30,4 +30,17 @@ atomic_add(volatile int *addr, int val)
 	return (val);
 }
 
+/*
+** Returns the number of cycles since the cpu was reset, to time short operations.
+*/
+static inline uint64
+get_cycles(void)
+{
+	uint32 lo;
+	uint32 hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (((uint64)hi << 32u) | lo);
+}
+
 #endif /* !_ARCH_X86_ARCH_COMMON_OP_H_ */
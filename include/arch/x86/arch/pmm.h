@@ -0,0 +1,43 @@
+/* ------------------------------------------------------------------------ *\
+**
+**  This file is part of the Chaos Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2017 - Benjamin Grange <benjamin.grange@epitech.eu>
+**
+\* ------------------------------------------------------------------------ */
+
+#ifndef _ARCH_X86_ARCH_PMM_H_
+# define _ARCH_X86_ARCH_PMM_H_
+
+/* The order and size of a large page, mapped by a single page directory entry */
+# define ARCH_LARGE_PAGE_ORDER		(10u)
+# define ARCH_LARGE_PAGE_SIZE		(PAGE_SIZE << ARCH_LARGE_PAGE_ORDER)
+
+/* Test if a given address is aligned on a large page */
+# define IS_LARGE_PAGE_ALIGNED(x)	(!((uintptr)(x) & (ARCH_LARGE_PAGE_SIZE - 1u)))
+
+/*
+** The amount of physical memory, starting at address 0, mapped at
+** KERNEL_VIRTUAL_BASE by boot.asm before any memory manager is up.
+** It is a single large page, replaced by a page table in arch_vmm_init() that
+** only maps the memory reserved at boot.
+*/
+# define ARCH_BOOT_MAPPING_SIZE		ARCH_LARGE_PAGE_SIZE
+
+/*
+** The kernel virtual addresses handed out by vmalloc(), between the kernel heap
+** and the page allocator.
+*/
+# define ARCH_VMALLOC_START		((void *)0xE0000000ul)
+# define ARCH_VMALLOC_END		((void *)0xF0000000ul)
+
+/*
+** The kernel virtual addresses handed out by alloc_kpages(), far above the kernel
+** heap and right below the page table holding the kmap window.
+*/
+# define ARCH_KPAGES_START		((void *)0xF0000000ul)
+# define ARCH_KPAGES_SIZE		(0x0F800000ul)
+# define ARCH_KPAGES_END		((void *)(0xF0000000ul + ARCH_KPAGES_SIZE))
+
+#endif /* !_ARCH_X86_ARCH_PMM_H_ */
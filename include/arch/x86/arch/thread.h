@@ -12,6 +12,8 @@
 
 # include <arch/x86/interrupts.h>
 
+struct kmem_cache;
+
 struct		arch_thread
 {
 	/* Stack pointer of the thread, belongs to kernel stack */
@@ -41,6 +43,9 @@ struct		context_switch_frame
 	uintptr eip;
 };
 
+/* The cache the kernel stacks are allocated from */
+extern struct kmem_cache	*kernel_stack_cache;
+
 extern void 	x86_context_switch(void **old_esp, void *new_esp);
 extern void	x86_jump_userspace(void *, void *) __noreturn;
 extern void	x86_return_userspace(void *) __noreturn;
@@ -11,6 +11,7 @@
 # define _ARCH_X86_ASM_H_
 
 # include <chaosdef.h>
+# include <arch/x86/x86.h>
 
 static inline void
 cli(void)
@@ -78,16 +79,67 @@ set_cr3(uintptr cr3)
 	asm volatile("mov %0, %%cr3" :: "r"(cr3));
 }
 
+static inline uintptr
+get_cr4(void)
+{
+	uintptr cr4;
+
+	asm volatile("mov %%cr4, %0" : "=r"(cr4));
+	return (cr4);
+}
+
+static inline void
+set_cr4(uintptr cr4)
+{
+	asm volatile("mov %0, %%cr4" :: "r"(cr4));
+}
+
+/*
+** Flushes the whole TLB, except global pages.
+*/
+static inline void
+flush_tlb(void)
+{
+	set_cr3(get_cr3());
+}
+
+/*
+** Flushes the whole TLB, including global pages.
+*/
+static inline void
+flush_tlb_global(void)
+{
+	uintptr cr4;
+
+	cr4 = get_cr4();
+	set_cr4(cr4 & ~CR4_PGE);
+	set_cr4(cr4);
+}
+
 static inline void
 interrupt(uchar i)
 {
 	asm volatile("int %0" :: "i" (i));
 }
 
+/*
+** Invalidates the TLB entry of the given page, even if it is a global one.
+** Reloading cr3 doesn't flush global pages.
+*/
 static inline void
 invlpg(void *va)
 {
 	asm volatile("invlpg (%0)" ::"r" (va) : "memory");
 }
 
+static inline uint64
+rdtsc(void)
+{
+	uint32 lo;
+	uint32 hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (((uint64)hi << 32u) | lo);
+}
+
 #endif /* !_ARCH_X86_ASM_H_ */
@@ -20,6 +20,16 @@
 # define GET_PT_IDX(x)		(((uintptr)(x) >> 12u) & 0x3FF)
 # define GET_VADDR(i, j)	((void *)((i) << 22u | (j) << 12u))
 
+/* Number of words of a bitmap with one bit per page directory entry */
+# define PD_BITMAP_SIZE		(1024u / 32u)
+
+/*
+** Virtual pages used by kmap() to reach frames that aren't mapped anywhere,
+** or not in the current virtual address space, right below the recursive mapping.
+*/
+# define KMAP_WINDOW		((void *)0xFFBF0000ul)
+# define KMAP_SLOTS		(16u)
+
 /*
 ** An entry in the page directory
 */
@@ -37,7 +47,8 @@ struct			pagedir_entry
 			uint32 accessed : 1;	/* set by cpu when accessed */
 			uint32 _zero : 1;	/* Must be 0 */
 			uint32 size : 1;	/* 0 => 4KiB page, 1 => 4MiB page */
-			uint32 __unusued : 4;	/* unused & reserved bits */
+			uint32 global : 1;	/* Prevent tlb update (4MiB pages only) */
+			uint32 __unusued : 3;	/* unused & reserved bits */
 			uint32 frame : 20;	/* Frame address */
 		};
 		uintptr value;
@@ -62,7 +73,9 @@ struct			pagetable_entry
 			uint32 dirty : 1;	/* Set by cpu when writting */
 			uint32 _zero : 1;	/* Must be zero */
 			uint32 global : 1;	/* Prevent tlb update */
-			uint32 __unusued : 3;	/* unused & reserved bits */
+			uint32 cow : 1;		/* Shared read-only until the next write (available bit) */
+			uint32 lazy : 1;	/* Reserved, backed by a frame on the first access (available bit) */
+			uint32 __unusued : 1;	/* unused & reserved bits */
 			uint32 frame : 20;	/* Frame address */
 		};
 		uintptr value;
@@ -89,8 +102,14 @@ static_assert(sizeof(struct pagedir_entry) == sizeof(uintptr));
 static_assert(sizeof(struct pagetable_entry) == sizeof(uintptr));
 static_assert(sizeof(struct page_table) == PAGE_SIZE);
 static_assert(sizeof(struct page_dir) == PAGE_SIZE);
+static_assert(KMAP_SLOTS <= sizeof(uint32) * 8);
 
 phys_addr_t		get_paddr(virt_addr_t);
 phys_addr_t		set_paddr(virt_addr_t va, phys_addr_t pa);
+status_t		arch_split_large_page(virt_addr_t va);
+bool			handle_cow_fault(virt_addr_t va);
+bool			handle_lazy_fault(virt_addr_t va);
+virt_addr_t		kmap(phys_addr_t pa);
+void			kunmap(virt_addr_t va);
 
 #endif /* !_ARCH_X86_VMM_H_ */
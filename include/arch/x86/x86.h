@@ -57,4 +57,10 @@ enum			dpl
 # define FL_VIP		(0x00100000) // Virtual Interrupt Pending
 # define FL_ID		(0x00200000) // ID flag
 
+/*
+** Control register 4 flags.
+*/
+# define CR4_PSE	(0x00000010) // Page Size Extension
+# define CR4_PGE	(0x00000080) // Page Global Enable
+
 #endif /* !_ARCH_X86_X86_H_ */
@@ -70,4 +70,7 @@ typedef uintptr_t		uintptr;
 # define ROUND_DOWN(x, y)	((x) & ~((y) - 1))
 # define ALIGN(x, y)		(((x) + ((y) - 1)) & ~((y) - 1))
 
+# define MIN(x, y)		((x) < (y) ? (x) : (y))
+# define MAX(x, y)		((x) > (y) ? (x) : (y))
+
 #endif /* !_CHAOS_DEF_H_ */
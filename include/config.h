@@ -20,12 +20,89 @@
 /* Maximum number of processes running at the same time */
 # define MAX_PID			(32)
 
+/* Maximum number of regions in the user space of a virtual address space */
+# define MAX_VMAS			(64)
+
 /* Default size of a thread's stack */
 # define DEFAULT_STACK_SIZE		(PAGE_SIZE * 16u)
 
 /* Default size of a thread's kernel stack */
 # define DEFAULT_KERNEL_STACK_SIZE	(PAGE_SIZE * 4u)
 
+/*
+** Number of pre-zeroed frames kept aside to back new pages. The thread clearing
+** them sleeps once the pool is full, until it drops below ZERO_POOL_LOW_WATERMARK.
+**
+** ZERO_POOL_LARGE_SIZE is the maximum number of pre-zeroed blocks kept aside
+** to back large pages, which are only used when such a block is ready. Blocks
+** are only prepared once a large mapping has asked for one.
+*/
+# define ZERO_POOL_SIZE			(64u)
+# define ZERO_POOL_LOW_WATERMARK	(ZERO_POOL_SIZE / 2u)
+# define ZERO_POOL_LARGE_SIZE		(1u)
+
+/*
+** Number of reserved pages backed ahead of time when a page fault reveals a
+** sequential access. Set it to 0 to only back the pages that are touched.
+*/
+# define FAULT_AROUND_PAGES		(4u)
+
+/*
+** [X86] Number of pages above which unmapping a range flushes the whole TLB once,
+** instead of invalidating each page on its own.
+*/
+# define TLB_FLUSH_THRESHOLD		(32u)
+
+/*
+** Number of priorities of the scheduler, 0 being the highest.
+** A thread gets a time slice of SCHED_QUANTUM ticks at priority 0, twice longer at
+** each lower priority, and goes down one priority each time it uses a whole one.
+** All threads get back to their nice priority every SCHED_AGING_PERIOD ticks.
+*/
+# define SCHED_NB_PRIORITIES		(4u)
+# define SCHED_QUANTUM			(1u)
+# define SCHED_AGING_PERIOD		(64u)
+
+/*
+** Order (log2 of the number of pages) of the slabs small kernel allocations are
+** carved from. Bigger slabs waste less memory on the biggest size classes.
+*/
+# define SLAB_ORDER			(2u)
+
+/*
+** Maximum number of allocations served by vmalloc() at the same time.
+** Beyond it, kalloc() serves big allocations from the heap.
+*/
+# define MAX_VMALLOC_AREAS		(128u)
+
+/*
+** The free space at the end of the kernel heap is given back to the physical
+** memory allocator once it reaches KHEAP_TRIM_THRESHOLD bytes, down to
+** KHEAP_TRIM_KEEP bytes, so that the heap doesn't shrink and grow back over and
+** over again. KHEAP_TRIM_KEEP must be smaller than KHEAP_TRIM_THRESHOLD.
+*/
+# define KHEAP_TRIM_THRESHOLD		(PAGE_SIZE * 64u)
+# define KHEAP_TRIM_KEEP		(PAGE_SIZE * 16u)
+
+/*
+** Uncomment to record who allocates kernel memory: kalloc() and friends then keep,
+** for each call site, the number of allocations and the bytes still in use.
+** The report is printed by the 'kmemstat' command and when the kernel panics.
+**
+** KALLOC_PROFILER_SITES is the number of call sites that can be told apart, and
+** KALLOC_PROFILER_LIVE the number of allocations that can be followed until they
+** are freed. Both must be powers of two.
+*/
+/* # define ENABLE_KALLOC_PROFILER */
+# define KALLOC_PROFILER_SITES		(256u)
+# define KALLOC_PROFILER_LIVE		(4096u)
+
+/*
+** Uncomment to fill new pages with garbage instead of zeroes, to catch code reading
+** memory it never initialized. This also disables the pool of pre-zeroed frames.
+*/
+/* # define ENABLE_PAGE_POISON */
+
 /* [X86] Comment to disable SSE instructions (floating points) */
 /* TODO Not implemented yet */
 # define ENABLE_SSE
@@ -37,4 +114,24 @@
 #  error "MAX_PID is less than one"
 # endif /* MAX_PID < 1 */
 
+# if MAX_VMAS < 2
+#  error "MAX_VMAS is less than two"
+# endif /* MAX_VMAS < 2 */
+
+# if SCHED_NB_PRIORITIES < 1
+#  error "SCHED_NB_PRIORITIES is less than one"
+# endif /* SCHED_NB_PRIORITIES < 1 */
+
+# if ZERO_POOL_SIZE < 1
+#  error "ZERO_POOL_SIZE is less than one"
+# endif /* ZERO_POOL_SIZE < 1 */
+
+# if ZERO_POOL_LARGE_SIZE < 1
+#  error "ZERO_POOL_LARGE_SIZE is less than one"
+# endif /* ZERO_POOL_LARGE_SIZE < 1 */
+
+# if ZERO_POOL_LOW_WATERMARK > ZERO_POOL_SIZE
+#  error "ZERO_POOL_LOW_WATERMARK is greater than ZERO_POOL_SIZE"
+# endif /* ZERO_POOL_LOW_WATERMARK > ZERO_POOL_SIZE */
+
 #endif /* !_CONFIG_ */
@@ -42,5 +42,6 @@ void			arch_disable_interrupts(void);
 void			arch_push_interrupts(int_state_t *);
 void			arch_pop_interrupts(int_state_t *);
 bool			arch_are_int_enabled(void);
+void			arch_wait_interrupt(void);
 
 #endif /* !_LIB_INTERRUPTS_H_ */
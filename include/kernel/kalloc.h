@@ -14,6 +14,7 @@
 # include <kernel/spinlock.h>
 # include <kernel/interrupts.h>
 # include <chaosdef.h>
+# include <config.h>
 
 struct block
 {
@@ -28,10 +29,36 @@ struct alloc_datas
 	struct block *tail;
 };
 
+/*
+** Statistics about the kernel heap.
+*/
+struct kheap_stats
+{
+	size_t nb_trims;		/* Number of times the free end of the heap was given back */
+	size_t pages_returned;		/* Number of pages given back to the physical memory allocator */
+};
+
+/*
+** Allocations up to KALLOC_MAX_SIZE bytes are served by caches of objects whose
+** size is a power of two, starting at 2^KALLOC_MIN_ORDER bytes.
+** Bigger ones are served by the heap.
+*/
+# define KALLOC_MIN_ORDER	(3u)
+# define KALLOC_MAX_ORDER	(11u)
+# define KALLOC_MAX_SIZE	(1u << KALLOC_MAX_ORDER)
+# define KALLOC_NB_CLASSES	(KALLOC_MAX_ORDER - KALLOC_MIN_ORDER + 1)
+
 virt_addr_t	kalloc(size_t);
 virt_addr_t	krealloc(virt_addr_t, size_t);
 virt_addr_t	kcalloc(size_t, size_t);
 void		kfree(virt_addr_t);
+void		kheap_get_stats(struct kheap_stats *);
+
+# ifdef ENABLE_KALLOC_PROFILER
+void		kalloc_profiler_alloc(virt_addr_t ptr, size_t size, void *caller, void *parent);
+void		kalloc_profiler_free(virt_addr_t ptr);
+void		kalloc_profiler_dump(void);
+# endif /* ENABLE_KALLOC_PROFILER */
 
 static_assert(sizeof(struct block) % sizeof(void *) == 0);
 
@@ -38,6 +38,8 @@ struct multiboot_info
 	multiboot_memory_map_t *mmap_end;
 	size_t mmap_entry_size;
 	struct initrd_infos initrd;
+	phys_addr_t pstart;		/* Physical range of the multiboot structure itself */
+	phys_addr_t pend;
 };
 
 extern struct cmd_options cmd_options;
@@ -11,7 +11,9 @@
 # define _KERNEL_PMM_H_
 
 # include <chaosdef.h>
+# include <chaoserr.h>
 # include <kernel/linker.h>
+# include <arch/pmm.h>
 # include <limits.h>
 
 /* A physical address */
@@ -20,22 +22,151 @@ typedef uintptr			phys_addr_t;
 /* The NULL equivalent for physical memory */
 # define NULL_FRAME		(-1u)
 
-/* The number of frames */
+/* The maximum number of frames */
 # define NB_FRAMES		((UINTPTR_MAX / PAGE_SIZE) + 1)
 
-/* *The number of cells of the frame bitmap */
-# define FRAME_BITMAP_SIZE	(NB_FRAMES / 8u)
+/* The number of frames tracked by each cell of the frame bitmap */
+# define FRAME_BITMAP_BITS	(sizeof(uint32) * 8u)
+
+/* The value of a cell of the frame bitmap when all its frames are taken */
+# define FRAME_BITMAP_FULL	(0xFFFFFFFFu)
+
+/*
+** The number of frames tracked by each cell of the summary bitmaps (one bit per cell
+** of the frame bitmap). The number of frames tracked by the PMM is a multiple of it.
+*/
+# define FRAME_SUMMARY_FRAMES	(FRAME_BITMAP_BITS * FRAME_BITMAP_BITS)
 
 /* Macro to easily get the index in the bitmap of any physical address */
-# define GET_FRAME_IDX(x)		(((x) >> 12u) / 8u)
-# define GET_FRAME_MASK(x)		(1 << (((x) >> 12) % 8u))
+# define GET_FRAME_IDX(x)		(((x) >> 12u) / FRAME_BITMAP_BITS)
+# define GET_FRAME_MASK(x)		(1u << (((x) >> 12u) % FRAME_BITMAP_BITS))
+
+/* The highest order (log2 of the number of frames) of a block given by alloc_frames() */
+# define PMM_MAX_ORDER		(10u)
+
+/* Macro to get the index in the summary bitmaps of any cell of the frame bitmap */
+# define GET_SUMMARY_IDX(x)		((x) / FRAME_BITMAP_BITS)
+# define GET_SUMMARY_MASK(x)		(1u << ((x) % FRAME_BITMAP_BITS))
+
+/* The maximum number of usable memory regions tracked by the PMM */
+# define PMM_MAX_REGIONS		(16u)
+
+/* The end of the memory reachable by ISA DMA, and therefore of the DMA zone */
+# define PMM_DMA_LIMIT			(16u * 1024u * 1024u)
+
+/*
+** The physical memory is split in zones, ordered by address.
+** An allocation targeting a zone falls back to the zones below it when
+** it's exhausted, but never to the ones above it.
+*/
+enum zone_type
+{
+	ZONE_DMA = 0,			/* Below PMM_DMA_LIMIT */
+	ZONE_NORMAL,			/* Everything else */
+	NB_ZONES,
+};
+
+/*
+** A zone of physical memory.
+*/
+struct pmm_zone
+{
+	size_t start;			/* Index of the first frame of the zone */
+	size_t end;			/* Index of the frame following the zone */
+	size_t nb_free;			/* Number of free frames within the zone */
+	size_t watermark;		/* Free frames kept for allocations targeting this zone */
+	size_t next_frame;		/* Index of the frame the next search starts at */
+};
+
+/*
+** A range of usable physical memory, as given by the bootloader.
+*/
+struct pmm_region
+{
+	size_t start;			/* Index of the first frame of the region */
+	size_t end;			/* Index of the frame following the region */
+	size_t nb_free;			/* Number of free frames within the region */
+	size_t nb_used;			/* Number of used frames within the region */
+};
+
+/*
+** The descriptor of a frame. There is one for each frame tracked by the PMM,
+** so it must stay small.
+**
+** A frame is taken in the frame bitmap if and only if its reference count
+** isn't 0.
+*/
+struct page
+{
+	uint16 refcount;		/* Number of references to the frame */
+	uint8 flags;			/* PAGE_* flags below */
+	uint8 zone;			/* The zone holding the frame (enum zone_type) */
+};
+
+static_assert(sizeof(struct page) <= 8);
+
+/* The frame was reserved at boot (memory hole, kernel image...) and not given by an allocation */
+# define PAGE_RESERVED			(1u << 0)
+
+/* The maximum number of references to a frame */
+# define PAGE_MAX_REFCOUNT		(0xFFFFu)
+
+/*
+** A snapshot of the state of the physical memory manager.
+*/
+struct pmm_stats
+{
+	size_t nb_free;			/* Number of free frames */
+	size_t nb_used;			/* Number of used frames within the regions */
+	size_t largest_free_run;	/* Number of frames of the largest run of contiguous free frames */
+	size_t nb_regions;
+	struct pmm_region regions[PMM_MAX_REGIONS];
+	struct pmm_zone zones[NB_ZONES];
+};
 
 /* Physical allocation functions */
 phys_addr_t			alloc_frame(void);
 void				free_frame(phys_addr_t);
 size_t				nb_free_frames(void);
+phys_addr_t			alloc_frames(uint order);
+phys_addr_t			alloc_frame_zone(enum zone_type);
+phys_addr_t			alloc_frames_zone(uint order, enum zone_type);
+void				get_page(phys_addr_t);
+void				put_page(phys_addr_t);
+void				free_frames(phys_addr_t, uint order);
+void				pmm_get_stats(struct pmm_stats *);
+status_t			pmm_audit(void);
 
-extern uchar			frame_bitmap[FRAME_BITMAP_SIZE];
+/*
+** The frame bitmap holds one bit per frame, set if the frame is taken.
+**
+** The summary bitmap holds one bit per cell of the frame bitmap, set if
+** at least one frame of that cell is free. It lets the allocator skip
+** full cells without looking at them.
+**
+** The empty bitmap holds one bit per cell of the frame bitmap, set if
+** all the frames of that cell are free. It is used to find big blocks
+** of contiguous frames.
+**
+** They are sized to the highest usable address given by the bootloader
+** (nb_frames frames) and live, along with the frame descriptors, in
+** physical memory reserved at boot.
+** Frames beyond them don't exist and are considered taken.
+*/
+extern uint32			*frame_bitmap;
+extern uint32			*frame_summary;
+extern uint32			*frame_empty;
+extern size_t			nb_frames;
+
+/* The descriptors of the frames, one for each frame tracked by the PMM */
+extern struct page		*pages;
+
+/*
+** The last frame reserved at boot, either by the kernel image or by the data
+** structures of the PMM. Everything up to it must stay mapped at
+** KERNEL_VIRTUAL_BASE + its physical address.
+*/
+extern phys_addr_t		boot_memory_end;
 
 /*
 ** Returns true if the given address is taken.
@@ -44,27 +175,21 @@ static bool
 is_frame_allocated(phys_addr_t frame)
 {
 	assert(IS_PAGE_ALIGNED(frame));
+	if (frame / PAGE_SIZE >= nb_frames) {
+		return (true);
+	}
 	return (frame_bitmap[GET_FRAME_IDX(frame)] & (GET_FRAME_MASK(frame)));
 }
 
 /*
-** Mark a frame as allocated.
-*/
-static inline void
-mark_frame_as_allocated(phys_addr_t frame)
-{
-	assert(IS_PAGE_ALIGNED(frame));
-	frame_bitmap[GET_FRAME_IDX(frame)] |= GET_FRAME_MASK(frame);
-}
-
-/*
-** Mark a frame as freed.
+** Returns the descriptor of the given frame.
 */
-static inline void
-mark_frame_as_free(phys_addr_t frame)
+static inline struct page *
+phys_to_page(phys_addr_t frame)
 {
 	assert(IS_PAGE_ALIGNED(frame));
-	frame_bitmap[GET_FRAME_IDX(frame)] &= ~GET_FRAME_MASK(frame);
+	assert(frame / PAGE_SIZE < nb_frames);
+	return (pages + frame / PAGE_SIZE);
 }
 
 #endif /* !_KERNEL_PMM_H_ */
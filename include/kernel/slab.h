@@ -0,0 +1,87 @@
+/* ------------------------------------------------------------------------ *\
+**
+**  This file is part of the Chaos Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2017 - Benjamin Grange <benjamin.grange@epitech.eu>
+**
+\* ------------------------------------------------------------------------ */
+
+#ifndef _KERNEL_SLAB_H_
+# define _KERNEL_SLAB_H_
+
+# include <kernel/vmm.h>
+# include <kernel/list.h>
+# include <kernel/spinlock.h>
+# include <config.h>
+
+/* The size of the slabs of the size classes of kalloc(), on which they are aligned */
+# define SLAB_SIZE		(PAGE_SIZE << SLAB_ORDER)
+
+/* Stored in the header of every slab, to tell them apart from other kernel pages */
+# define SLAB_MAGIC		(0x51AB51ABu)
+
+/* Called on each object of a cache when it is created */
+typedef void		(*kmem_ctor_t)(virt_addr_t);
+
+/*
+** A cache of objects of the same size, carved from slabs.
+*/
+struct kmem_cache
+{
+	char const *name;
+	size_t size;			/* Size of the objects */
+	size_t stride;			/* Space between two objects */
+	size_t link;			/* Offset of the free list link within a free object */
+	size_t offset;			/* Offset of the first object within a slab */
+	size_t nb_per_slab;		/* Number of objects held by a slab */
+	uint order;			/* Order of the slabs, which are aligned on their size */
+	kmem_ctor_t ctor;		/* Constructor of the objects, or NULL */
+	struct list_node partial;	/* Slabs with at least a free object */
+	struct list_node node;		/* Node in the list of all caches */
+	struct spinlock lock;
+
+	/* Statistics */
+	size_t nb_slabs;		/* Number of slabs */
+	size_t nb_active;		/* Number of objects in use */
+	size_t nb_allocs;		/* Number of allocations since the creation of the cache */
+};
+
+/*
+** The header of a slab, at its very beginning.
+** The objects are stored at its end, so that they are aligned as requested.
+*/
+struct slab
+{
+	struct list_node node;		/* Node in the partial list of its cache, if it isn't full */
+	struct kmem_cache *cache;	/* The cache the slab belongs to */
+	void *free;			/* First free object, holding the address of the next one */
+	size_t nb_free;			/* Number of free objects */
+	uint32 magic;			/* SLAB_MAGIC */
+};
+
+/*
+** A snapshot of the state of a cache.
+*/
+struct kmem_cache_stats
+{
+	char const *name;
+	size_t size;			/* Size of the objects */
+	size_t nb_slabs;		/* Number of slabs */
+	size_t nb_active;		/* Number of objects in use */
+	size_t nb_free;			/* Number of free objects within the slabs */
+	size_t nb_allocs;		/* Number of allocations since the creation of the cache */
+};
+
+struct kmem_cache	*kmem_cache_create(char const *name, size_t size, size_t align, kmem_ctor_t ctor);
+void			kmem_cache_init(struct kmem_cache *, char const *name, size_t size, size_t align, kmem_ctor_t ctor);
+void			kmem_cache_destroy(struct kmem_cache *);
+void			kmem_cache_fini(struct kmem_cache *);
+virt_addr_t		kmem_cache_alloc(struct kmem_cache *);
+void			kmem_cache_free(struct kmem_cache *, virt_addr_t);
+void			kmem_cache_get_stats(struct kmem_cache *, struct kmem_cache_stats *);
+void			kmem_cache_dump(void);
+bool			is_slab_object(virt_addr_t);
+struct kmem_cache	*get_slab_cache(virt_addr_t);
+
+#endif /* !_KERNEL_SLAB_H_ */
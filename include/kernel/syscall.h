@@ -25,6 +25,9 @@ enum syscalls_values
 	GETPID		= 7,
 	WAITPID		= 8,
 	EXECVE		= 9,
+	YIELD		= 10,
+	KMEMSTAT	= 11,
+	NICE		= 12,
 };
 
 static char const *const syscalls_str[] =
@@ -39,11 +42,16 @@ static char const *const syscalls_str[] =
 	[GETPID]	= "GETPID",
 	[WAITPID]	= "WAITPID",
 	[EXECVE]	= "EXECVE",
+	[YIELD]		= "YIELD",
+	[KMEMSTAT]	= "KMEMSTAT",
+	[NICE]		= "NICE",
 };
 
 int			sys_open(char const *path);
 int			sys_write(int fd, char const *, size_t);
 int			sys_read(int fd, char *, size_t);
 pid_t			sys_fork(void);
+void			sys_kmemstat(void);
+int			sys_nice(int inc);
 
 #endif /* !_KERNEL_SYSCALL_H_ */
@@ -12,6 +12,7 @@
 
 # include <kernel/vmm.h>
 # include <kernel/vaspace.h>
+# include <kernel/list.h>
 # include <arch/thread.h>
 # include <chaosdef.h>
 # include <config.h>
@@ -50,6 +51,14 @@ struct			thread
 	struct thread *parent;
 	char *cwd;
 
+	/* Node in the run queue while the thread is RUNNABLE, or in a wait queue while it is SUSPENDED */
+	struct list_node rq_node;
+
+	/* Scheduling */
+	uint priority;			/* Current priority, 0 being the highest */
+	uint nice;			/* Highest priority the thread can get */
+	uint slice;			/* Ticks left before the thread is demoted */
+
 	/* Thread stack */
 	virt_addr_t stack;
 	size_t stack_size;
@@ -73,6 +82,11 @@ struct thread		*thread_create(char const *name, thread_entry_cb entry, size_t st
 void			thread_dump(void);
 void			thread_yield(void);
 void			thread_reschedule(void);
+void			thread_set_runnable(struct thread *);
+void			thread_set_nice(struct thread *, uint nice);
+void			thread_wait(struct list_node *wait_queue);
+bool			thread_wakeup(struct list_node *wait_queue);
+size_t			sched_get_idle_ticks(void);
 void			thread_resume(struct thread *);
 void			thread_exit(int);
 int			thread_waitpid(pid_t);
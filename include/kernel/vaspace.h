@@ -12,8 +12,11 @@
 
 # include <arch/vaspace.h>
 # include <kernel/spinlock.h>
+# include <kernel/vma.h>
+# include <config.h>
 
 struct thread;
+struct kmem_cache;
 
 /*
 ** Represents the virtual address space of a thread.
@@ -26,9 +29,8 @@ struct vaspace
 
 	/* 0xCFFFFFFF */
 
-	/* Memory Mapping segment (stacks, dynamic libraries etc.) (goes downward) */
+	/* Memory Mapping segment (stacks, dynamic libraries etc.) (filled downward) */
 	void *mmapping_start;			 /* MUST BE PAGE ALIGNED */
-	size_t mmapping_size;			 /* MUST BE PAGE ALIGNED */
 
 	/* heap segment (goes upward) */
 	size_t heap_size;
@@ -39,6 +41,10 @@ struct vaspace
 
 	/* 0x00000000 */
 
+	/* Regions of user space, sorted by address and never overlapping */
+	struct vma vmas[MAX_VMAS];
+	size_t nb_vmas;
+
 	struct arch_vaspace arch;
 
 	/* Locker to lock the virtual address space */
@@ -48,6 +54,21 @@ struct vaspace
 	uint ref_count;
 };
 
+/*
+** Statistics about the cost of forking virtual address spaces.
+*/
+struct fork_stats
+{
+	size_t nb_forks;		/* Number of virtual address spaces cloned */
+	uint64 fork_time;		/* Total time spent cloning them, in arch-dependant units */
+	size_t pages_shared;		/* Number of pages shared between a parent and its child */
+	size_t pages_copied;		/* Number of shared pages copied on their first write */
+	size_t pages_reused;		/* Number of shared pages made writable again without a copy */
+};
+
+/* The cache the virtual address spaces of forked threads are allocated from */
+extern struct kmem_cache	*vaspace_cache;
+
 struct vaspace			*setup_boot_vaspace(void);
 struct vaspace			*clone_vaspace(struct vaspace *src);
 void				init_vaspace(void);
@@ -59,5 +80,6 @@ struct vaspace			*arch_clone_vaspace(struct vaspace *src);
 void				arch_init_vaspace(void);
 void				arch_free_vaspace(void);
 void				arch_free_zombie_thread(struct thread *t);
+void				arch_get_fork_stats(struct fork_stats *);
 
 #endif /* !_KERNEL_VASPACE_H_ */
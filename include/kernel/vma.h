@@ -0,0 +1,34 @@
+/* ------------------------------------------------------------------------ *\
+**
+**  This file is part of the Chaos Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2017 - Benjamin Grange <benjamin.grange@epitech.eu>
+**
+\* ------------------------------------------------------------------------ */
+
+#ifndef _KERNEL_VMA_H_
+# define _KERNEL_VMA_H_
+
+# include <kernel/vmm.h>
+# include <chaosdef.h>
+# include <chaoserr.h>
+
+struct vaspace;
+
+/*
+** A region of user space, made of contiguous pages mapped with the same flags.
+*/
+struct vma
+{
+	uintptr start;			/* First address of the region */
+	uintptr end;			/* Address right after the region */
+	mmap_flags_t flags;		/* Protection of the pages (MMAP_USER and MMAP_WRITE) */
+};
+
+struct vma		*vma_find(struct vaspace *, virt_addr_t va);
+status_t		vma_insert(struct vaspace *, virt_addr_t va, size_t size, mmap_flags_t);
+status_t		vma_remove(struct vaspace *, virt_addr_t va, size_t size);
+virt_addr_t		vma_find_gap(struct vaspace *, virt_addr_t low, virt_addr_t high, size_t size);
+
+#endif /* !_KERNEL_VMA_H_ */
@@ -22,6 +22,8 @@ typedef void 		*virt_addr_t;
 # define MMAP_DEFAULT		0b00000000	/* Kernel space, read only */
 # define MMAP_USER		0b00000001	/* Page belongs to user space */
 # define MMAP_WRITE		0b00000010	/* Page is writtable */
+# define MMAP_LAZY		0b00000100	/* Page is backed by a frame on the first access */
+# define MMAP_LARGE		0b00001000	/* Page is a large one (ARCH_LARGE_PAGE_SIZE) */
 
 /* The integer type corresponding to the flags above */
 typedef uintptr			mmap_flags_t;
@@ -46,11 +48,32 @@ status_t		arch_map_virt_to_phys(virt_addr_t, phys_addr_t, mmap_flags_t);
 */
 status_t		arch_map_page(virt_addr_t va, mmap_flags_t);
 
+/*
+** Maps a range of virtual addresses to random physical addresses, or reserves it.
+*/
+status_t		arch_map_range(virt_addr_t va, size_t size, mmap_flags_t);
+
+/*
+** Maps a range of virtual addresses to a range of physical ones.
+*/
+status_t		arch_map_phys_range(virt_addr_t va, phys_addr_t pa, size_t size, mmap_flags_t);
+
+/*
+** Reserves the given virtual address, that will be backed by a random physical
+** address on the first access.
+*/
+status_t		arch_reserve_page(virt_addr_t va, mmap_flags_t);
+
 /*
 ** Unmaps a virtual address.
 */
 void			arch_munmap_va(virt_addr_t va);
 
+/*
+** Unmaps a range of virtual addresses.
+*/
+void			arch_munmap_range(virt_addr_t va, size_t size);
+
 /*
 ** Initialises the arch-dependent stuff of virtual memory management.
 */
@@ -67,6 +90,14 @@ status_t		kbrk(virt_addr_t new_brk);
 virt_addr_t		ksbrk(intptr);
 status_t		ubrk(virt_addr_t new_brk);
 virt_addr_t		usbrk(intptr inc);
+virt_addr_t		alloc_kpages(uint order);
+void			free_kpages(virt_addr_t va, uint order);
+virt_addr_t		map_kpages(phys_addr_t pa, size_t size);
+virt_addr_t		vmalloc(size_t size);
+void			vfree(virt_addr_t va);
+bool			vresize(virt_addr_t va, size_t size);
+size_t			vmalloc_size(virt_addr_t va);
+bool			is_vmalloc_addr(virt_addr_t va);
 
 # define LOCK_VASPACE(state)	LOCK(&get_current_thread()->vaspace->lock, state)
 # define RELEASE_VASPACE(state)	RELEASE(&get_current_thread()->vaspace->lock, state)
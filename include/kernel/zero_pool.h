@@ -0,0 +1,46 @@
+/* ------------------------------------------------------------------------ *\
+**
+**  This file is part of the Chaos Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2017 - Benjamin Grange <benjamin.grange@epitech.eu>
+**
+\* ------------------------------------------------------------------------ */
+
+#ifndef _KERNEL_ZERO_POOL_H_
+# define _KERNEL_ZERO_POOL_H_
+
+# include <kernel/pmm.h>
+# include <config.h>
+
+/* The value new pages that don't come from the pool are filled with */
+# ifdef ENABLE_PAGE_POISON
+#  define NEW_PAGE_FILL		(42)
+# else
+#  define NEW_PAGE_FILL		(0)
+# endif
+
+/*
+** A snapshot of the state of the pool of pre-zeroed frames.
+*/
+struct zero_pool_stats
+{
+	size_t nb_frames;		/* Number of frames waiting in the pool */
+	size_t hits;			/* Number of new pages given a pre-zeroed frame */
+	size_t misses;			/* Number of new pages that had to be cleared inline */
+	size_t nb_large;		/* Number of blocks for large pages waiting in the pool */
+};
+
+phys_addr_t		zero_pool_get(void);
+phys_addr_t		zero_pool_get_large(void);
+bool			zero_pool_refill(void);
+void			zero_pool_get_stats(struct zero_pool_stats *);
+void			zero_pool_start(void);
+
+/*
+** Fills the given frame with zeroes. The frame must not be mapped anywhere.
+** Must be implemented in each architecture.
+*/
+void			arch_zero_frame(phys_addr_t);
+
+#endif /* !_KERNEL_ZERO_POOL_H_ */
@@ -28,5 +28,8 @@ void		*sbrk(intptr inc);
 pid_t		getpid(void);
 int		waitpid(pid_t);
 status_t	execve(char const *, int (*)(void));
+void		yield(void);
+void		kmemstat(void);
+int		nice(int inc);
 
 #endif /* !_UNISTD_H_ */
@@ -12,6 +12,7 @@
 #include <kernel/list.h>
 #include <kernel/init.h>
 #include <kernel/kalloc.h>
+#include <kernel/slab.h>
 #include <kernel/multiboot.h>
 #include <arch/common_op.h>
 #include <lib/bdev/mem.h>
@@ -19,6 +20,8 @@
 #include <string.h>
 
 static struct list_node mounts = LIST_INIT_VALUE(mounts);
+static struct kmem_cache *mount_cache;
+static struct kmem_cache *filehandler_cache;
 
 extern struct fs_hook const __start_fs_hook[] __weak;
 extern struct fs_hook const __end_fs_hook[] __weak;
@@ -83,7 +86,7 @@ put_mount(struct fs_mount *mount)
 			bdev_close(mount->bdev);
 		}
 		kfree(mount->path);
-		kfree(mount);
+		kmem_cache_free(mount_cache, mount);
 	}
 }
 
@@ -123,7 +126,7 @@ mount(char const *path, char const *device, struct fs_api *const api)
 		return (err);
 	}
 
-	mount = kalloc(sizeof(struct fs_mount));
+	mount = kmem_cache_alloc(mount_cache);
 	if (unlikely(!mount)) {
 		bdev_close(bdev);
 		return (ERR_NO_MEMORY);
@@ -205,7 +208,12 @@ fs_open(char const *path, struct filehandler **handler)
 		return (err);
 	}
 
-	fh = kalloc(sizeof(struct filehandler));
+	fh = kmem_cache_alloc(filehandler_cache);
+	if (unlikely(!fh)) {
+		mount->api->close(cookie);
+		put_mount(mount);
+		return (ERR_NO_MEMORY);
+	}
 	fh->cookie = cookie;
 	fh->mount = mount;
 	*handler = fh;
@@ -222,7 +230,7 @@ fs_close(struct filehandler *handler)
 		return (err);
 	}
 	put_mount(handler->mount);
-	kfree(handler);
+	kmem_cache_free(filehandler_cache, handler);
 	return (OK);
 }
 
@@ -363,6 +371,11 @@ static void
 init_fs(enum init_level il __unused)
 {
 	printf("[..]\tFilesystem");
+	mount_cache = kmem_cache_create("fs_mount", sizeof(struct fs_mount), 0, NULL);
+	filehandler_cache = kmem_cache_create("filehandler", sizeof(struct filehandler), 0, NULL);
+	assert_neq(mount_cache, NULL);
+	assert_neq(filehandler_cache, NULL);
+
 	if (multiboot_infos.initrd.present)
 	{
 		/* Set up initrd */
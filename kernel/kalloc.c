@@ -8,8 +8,11 @@
 \* ------------------------------------------------------------------------ */
 
 #include <kernel/kalloc.h>
+#include <kernel/slab.h>
 #include <kernel/spinlock.h>
 #include <kernel/init.h>
+#include <kernel/unit-tests.h>
+#include <arch/common_op.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -17,11 +20,34 @@
 ** Kernel memory allocator.
 ** This is NOT suitable for user-space memory allocation.
 **
-** This is a pretty naive and straightforward implementation.
-** It can definitely be improved, but i didn't want to waste
-** time doing it. Feel free to improve it :)
+** Small allocations, which are the vast majority, are rounded up to the
+** next power of two and served by the slab cache of that size, in O(1).
+**
+** Allocations of a page or more are served by vmalloc(), on their own pages,
+** so that freeing them doesn't leave big holes in the heap. They fall back to
+** the heap if vmalloc() fails, for instance when it can't track more areas.
+**
+** The others come from the heap, which is a pretty naive and straightforward
+** first-fit implementation. It can definitely be improved, but i didn't want
+** to waste time doing it. Feel free to improve it :)
+** Its free end is given back to the physical memory allocator when it gets
+** too big, see heap_trim().
 */
 
+/* The caches of the size classes, from 2^KALLOC_MIN_ORDER to KALLOC_MAX_SIZE bytes */
+static struct kmem_cache kalloc_caches[KALLOC_NB_CLASSES];
+static char const *kalloc_cache_names[KALLOC_NB_CLASSES] = {
+	"kalloc-8",
+	"kalloc-16",
+	"kalloc-32",
+	"kalloc-64",
+	"kalloc-128",
+	"kalloc-256",
+	"kalloc-512",
+	"kalloc-1024",
+	"kalloc-2048",
+};
+
 /* Malloc's data structures */
 struct alloc_datas alloc_datas =
 {
@@ -30,7 +56,20 @@ struct alloc_datas alloc_datas =
 };
 
 static struct spinlock kernel_heap_lock;
+static struct kheap_stats kheap_stats;
 
+/*
+** The profiler records the function calling kalloc() and the one calling it,
+** so that allocations made through a wrapper like strdup() are told apart.
+*/
+#ifdef ENABLE_KALLOC_PROFILER
+# define PROFILE_ALLOC(ptr, size)	\
+	kalloc_profiler_alloc(ptr, size, __builtin_return_address(0), __builtin_return_address(1))
+# define PROFILE_FREE(ptr)		kalloc_profiler_free(ptr)
+#else
+# define PROFILE_ALLOC(ptr, size)
+# define PROFILE_FREE(ptr)
+#endif /* ENABLE_KALLOC_PROFILER */
 
 /*
 ** Looks for a free block that can contain at least the given size.
@@ -103,11 +142,49 @@ join_block(struct block *block)
 }
 
 /*
-** malloc(), but using memory in kernel space.
-** TODO Make this function safer (overflow)
+** Gives the free end of the heap back to the physical memory allocator if it
+** grew past KHEAP_TRIM_THRESHOLD bytes, keeping KHEAP_TRIM_KEEP of them.
+** The heap must be locked.
 */
-virt_addr_t
-kalloc(size_t size)
+static void
+heap_trim(void)
+{
+	struct block *tail;
+	size_t size;
+
+	static_assert(KHEAP_TRIM_KEEP < KHEAP_TRIM_THRESHOLD);
+
+	tail = alloc_datas.tail;
+	if (tail == NULL || tail->used || tail->size < KHEAP_TRIM_THRESHOLD) {
+		return ;
+	}
+	size = ROUND_DOWN(tail->size - KHEAP_TRIM_KEEP, PAGE_SIZE);
+	if (ksbrk(-(intptr)size) != (void *)-1u)
+	{
+		tail->size -= size;
+		++kheap_stats.nb_trims;
+		kheap_stats.pages_returned += size / PAGE_SIZE;
+	}
+}
+
+/*
+** Returns the cache of the smallest size class holding the given size,
+** which must not be greater than KALLOC_MAX_SIZE.
+*/
+static struct kmem_cache *
+get_size_class(size_t size)
+{
+	if (size <= (1u << KALLOC_MIN_ORDER)) {
+		return (kalloc_caches);
+	}
+	return (kalloc_caches + (sizeof(uint) * 8 - __builtin_clz(size - 1) - KALLOC_MIN_ORDER));
+}
+
+/*
+** Allocates a block of the heap.
+*/
+static virt_addr_t
+heap_alloc(size_t size)
 {
 	struct block *block;
 
@@ -145,15 +222,36 @@ ret_err:
 }
 
 /*
-** free(), but using memory in kernel space.
-** TODO Make this function safer (overflow)
+** Allocates 'size' bytes from the slab caches, vmalloc() or the heap.
 */
-void
-kfree(virt_addr_t ptr)
+static virt_addr_t
+do_kalloc(size_t size)
+{
+	virt_addr_t ptr;
+
+	if (size <= KALLOC_MAX_SIZE) {
+		return (kmem_cache_alloc(get_size_class(size)));
+	} else if (size >= PAGE_SIZE && (ptr = vmalloc(size)) != NULL) {
+		return (ptr);
+	}
+	return (heap_alloc(size));
+}
+
+/*
+** Frees memory given by do_kalloc(), wherever it comes from.
+*/
+static void
+do_kfree(virt_addr_t ptr)
 {
 	struct block *block;
 
-	if (ptr)
+	if (ptr && is_slab_object(ptr)) {
+		kmem_cache_free(get_slab_cache(ptr), ptr);
+	}
+	else if (ptr && is_vmalloc_addr(ptr)) {
+		vfree(ptr);
+	}
+	else if (ptr)
 	{
 		LOCK_KHEAP(state);
 		block = (struct block *)((char *)ptr - sizeof(struct block));
@@ -163,10 +261,139 @@ kfree(virt_addr_t ptr)
 		if (block->prev) {
 			join_block(block->prev);
 		}
+		heap_trim();
 		RELEASE_KHEAP(state);
 	}
 }
 
+/*
+** Fills the given structure with the statistics of the kernel heap.
+*/
+void
+kheap_get_stats(struct kheap_stats *stats)
+{
+	LOCK_KHEAP(state);
+	memcpy(stats, &kheap_stats, sizeof(*stats));
+	RELEASE_KHEAP(state);
+}
+
+/*
+** Tries to resize the given block of the heap without moving it, by splitting it
+** when it shrinks, and when it grows by absorbing the next block if it's free or
+** by extending the heap if it's the last one.
+** Returns false if it has to be moved.
+*/
+static bool
+heap_resize(struct block *block, size_t size)
+{
+	struct block *next;
+
+	size += (size == 0);
+	size = ALIGN(size, sizeof(void *));
+
+	LOCK_KHEAP(state);
+	if (size <= block->size) {
+		split_block(block, size);
+		goto ret_resized;
+	}
+
+	next = (struct block *)((char *)block + sizeof(struct block) + block->size);
+	if (next <= alloc_datas.tail && !next->used)
+	{
+		/* join_block() only works on free blocks */
+		block->used = false;
+		join_block(block);
+		block->used = true;
+		if (size <= block->size) {
+			split_block(block, size);
+			goto ret_resized;
+		}
+	}
+
+	if (block == alloc_datas.tail && ksbrk(size - block->size) != (void *)-1u) {
+		block->size = size;
+		goto ret_resized;
+	}
+	RELEASE_KHEAP(state);
+	return (false);
+
+ret_resized:
+	/* The part split off may be followed by a free block */
+	next = (struct block *)((char *)block + sizeof(struct block) + block->size);
+	if (next <= alloc_datas.tail) {
+		join_block(next);
+	}
+	heap_trim();
+	RELEASE_KHEAP(state);
+	return (true);
+}
+
+/*
+** Objects that stay in the same size class, and areas of vmalloc() and blocks of
+** the heap that can be resized in place don't move, the others are copied.
+*/
+static virt_addr_t
+do_krealloc(virt_addr_t old, size_t ns)
+{
+	void *ptr;
+	size_t old_size;
+
+	old_size = 0;
+	if (old && is_slab_object(old))
+	{
+		if (ns <= KALLOC_MAX_SIZE && get_size_class(ns) == get_slab_cache(old)) {
+			return (old);
+		}
+		old_size = get_slab_cache(old)->size;
+	}
+	else if (old && is_vmalloc_addr(old))
+	{
+		if (ns >= PAGE_SIZE && vresize(old, ns)) {
+			return (old);
+		}
+		old_size = vmalloc_size(old);
+	}
+	else if (old)
+	{
+		if (ns > KALLOC_MAX_SIZE && ns < PAGE_SIZE && heap_resize((struct block *)((char *)old - sizeof(struct block)), ns)) {
+			return (old);
+		}
+		old_size = ((struct block *)((char *)old - sizeof(struct block)))->size;
+	}
+
+	ptr = do_kalloc(ns);
+	if (ptr != NULL && old) {
+		memcpy(ptr, old, old_size > ns ? ns : old_size);
+		do_kfree(old);
+	}
+	return (ptr);
+}
+
+/*
+** malloc(), but using memory in kernel space.
+** TODO Make this function safer (overflow)
+*/
+virt_addr_t
+kalloc(size_t size)
+{
+	virt_addr_t ptr;
+
+	ptr = do_kalloc(size);
+	PROFILE_ALLOC(ptr, size);
+	return (ptr);
+}
+
+/*
+** free(), but using memory in kernel space.
+** TODO Make this function safer (overflow)
+*/
+void
+kfree(virt_addr_t ptr)
+{
+	PROFILE_FREE(ptr);
+	do_kfree(ptr);
+}
+
 /*
 ** realloc(), but using memory in kernel space.
 ** TODO Make this function safer (overflow)
@@ -174,14 +401,12 @@ kfree(virt_addr_t ptr)
 virt_addr_t
 krealloc(virt_addr_t old, size_t ns)
 {
-	void *ptr;
-	struct block *block;
+	virt_addr_t ptr;
 
-	ptr = kalloc(ns);
-	if (ptr != NULL && old) {
-		block = (struct block *)((char *)old - sizeof(struct block));
-		memcpy(ptr, old, block->size > ns ? ns : block->size);
-		kfree(old);
+	ptr = do_krealloc(old, ns);
+	if (ptr != NULL) {
+		PROFILE_FREE(old);
+		PROFILE_ALLOC(ptr, ns);
 	}
 	return (ptr);
 }
@@ -195,18 +420,224 @@ kcalloc(size_t a, size_t b)
 {
 	void *ptr;
 
-	ptr = kalloc(a * b);
+	ptr = do_kalloc(a * b);
 	if (likely(ptr != NULL)) {
 		memset(ptr, 0, a * b);
 	}
+	PROFILE_ALLOC(ptr, a * b);
 	return (ptr);
 }
 
 static void
 init_kmalloc(enum init_level il __unused)
 {
+	size_t i;
+
 	init_lock(&kernel_heap_lock);
+	i = 0;
+	while (i < KALLOC_NB_CLASSES)
+	{
+		kmem_cache_init(kalloc_caches + i, kalloc_cache_names[i], 1u << (KALLOC_MIN_ORDER + i), 0, NULL);
+
+		/* kfree() finds the cache of an object assuming its slab is of order SLAB_ORDER */
+		assert_eq(kalloc_caches[i].order, SLAB_ORDER);
+		++i;
+	}
 	printf("[OK]\tKernel Heap\n");
 }
 
 NEW_INIT_HOOK(kmalloc, &init_kmalloc, CHAOS_INIT_LEVEL_VMM + 1);
+
+/*
+** Unit tests function
+*/
+
+static void
+kalloc_test(void)
+{
+	static uchar *ptrs[1024];
+	static size_t sizes[1024];
+	struct kheap_stats old;
+	struct kheap_stats stats;
+	virt_addr_t brk;
+	uint64 slab_time;
+	uint64 heap_time;
+	uint64 start;
+	uint32 seed;
+	size_t i;
+	size_t j;
+	size_t k;
+
+	/* Size classes */
+	assert_eq(get_size_class(0)->size, 8);
+	assert_eq(get_size_class(8)->size, 8);
+	assert_eq(get_size_class(9)->size, 16);
+	assert_eq(get_size_class(1025)->size, 2048);
+	assert_eq(get_size_class(KALLOC_MAX_SIZE)->size, KALLOC_MAX_SIZE);
+	assert(is_slab_object(ptrs[0] = kalloc(KALLOC_MAX_SIZE)));
+	assert(!is_slab_object(ptrs[1] = kalloc(KALLOC_MAX_SIZE + 1)));
+	assert(!is_slab_object(ptrs[2] = alloc_kpages(SLAB_ORDER)));
+	free_kpages(ptrs[2], SLAB_ORDER);
+	ptrs[2] = NULL;
+	assert_eq(krealloc(ptrs[0], KALLOC_MAX_SIZE - 1), ptrs[0]);
+	ptrs[0] = krealloc(ptrs[0], 16);
+	assert_eq(get_slab_cache(ptrs[0])->size, 16);
+	kfree(ptrs[0]);
+	kfree(ptrs[1]);
+	ptrs[0] = NULL;
+	ptrs[1] = NULL;
+
+	/* Allocations of a page or more get their own pages, resized in place when possible */
+	ptrs[0] = kalloc(PAGE_SIZE + 1);
+	assert(is_vmalloc_addr(ptrs[0]));
+	assert(!is_vmalloc_addr(ptrs[1] = kalloc(PAGE_SIZE - 1)));
+	assert_eq(krealloc(ptrs[0], 2 * PAGE_SIZE), ptrs[0]);
+	memset(ptrs[0], 42, 2 * PAGE_SIZE);
+	ptrs[0] = krealloc(ptrs[0], 3 * PAGE_SIZE);
+	assert_eq(ptrs[0][2 * PAGE_SIZE - 1], 42);
+	kfree(ptrs[0]);
+	kfree(ptrs[1]);
+	ptrs[0] = kalloc(64 * PAGE_SIZE);
+	memset(ptrs[0], 42, 64 * PAGE_SIZE);
+	assert_eq(krealloc(ptrs[0], 16 * PAGE_SIZE), ptrs[0]);	/* Shrinking */
+	assert_eq(vmalloc_size(ptrs[0]), 16 * PAGE_SIZE);
+	assert_eq(krealloc(ptrs[0], 48 * PAGE_SIZE), ptrs[0]);	/* Growing over the pages given back */
+	assert_eq(vmalloc_size(ptrs[0]), 48 * PAGE_SIZE);
+	assert_eq(ptrs[0][16 * PAGE_SIZE - 1], 42);
+	memset(ptrs[0], 42, 48 * PAGE_SIZE);
+	kfree(ptrs[0]);
+	ptrs[0] = NULL;
+	ptrs[1] = NULL;
+
+	/* Heap blocks are resized in place when possible (big enough not to fit in a hole) */
+	ptrs[0] = kalloc(KALLOC_MAX_SIZE + 512);
+	ptrs[1] = kalloc(KALLOC_MAX_SIZE + 512);
+	ptrs[2] = kalloc(KALLOC_MAX_SIZE + 512);
+	memset(ptrs[0], 42, KALLOC_MAX_SIZE + 512);
+	assert_eq(krealloc(ptrs[2], PAGE_SIZE - 128), ptrs[2]);	/* Tail of the heap */
+	kfree(ptrs[1]);
+	assert_eq(krealloc(ptrs[0], PAGE_SIZE - 128), ptrs[0]);	/* Free neighbour */
+	assert_eq(krealloc(ptrs[0], KALLOC_MAX_SIZE + 64), ptrs[0]);	/* Shrinking */
+	ptrs[1] = kalloc(KALLOC_MAX_SIZE + 512);
+	assert(ptrs[1] > ptrs[0] && ptrs[1] < ptrs[2]);
+	assert_eq(ptrs[0][0], 42);
+	assert_eq(ptrs[0][KALLOC_MAX_SIZE + 63], 42);
+	kfree(ptrs[0]);
+	kfree(ptrs[1]);
+	kfree(ptrs[2]);
+	ptrs[0] = NULL;
+	ptrs[1] = NULL;
+	ptrs[2] = NULL;
+
+	/* The free end of the heap is given back, but not below KHEAP_TRIM_KEEP bytes */
+	kheap_get_stats(&old);
+	i = 0;
+	while (i < KHEAP_TRIM_THRESHOLD * 2 / PAGE_SIZE) {
+		ptrs[i] = kalloc(PAGE_SIZE - 128);
+		++i;
+	}
+	brk = ksbrk(0);
+	i = 0;
+	while (i < KHEAP_TRIM_THRESHOLD * 2 / PAGE_SIZE) {
+		kfree(ptrs[i]);
+		ptrs[i] = NULL;
+		++i;
+	}
+	kheap_get_stats(&stats);
+	assert_eq(stats.nb_trims, old.nb_trims + 1);
+	assert(stats.pages_returned > old.pages_returned);
+	assert_eq((uintptr)brk - (uintptr)ksbrk(0), (stats.pages_returned - old.pages_returned) * PAGE_SIZE);
+	assert(alloc_datas.tail->size >= KHEAP_TRIM_KEEP && alloc_datas.tail->size < KHEAP_TRIM_KEEP + PAGE_SIZE);
+	i = 0;
+	while (i < (KHEAP_TRIM_THRESHOLD - KHEAP_TRIM_KEEP - PAGE_SIZE) / PAGE_SIZE) {
+		ptrs[i] = kalloc(PAGE_SIZE - 128);
+		++i;
+	}
+	i = 0;
+	while (i < (KHEAP_TRIM_THRESHOLD - KHEAP_TRIM_KEEP - PAGE_SIZE) / PAGE_SIZE) {
+		kfree(ptrs[i]);
+		ptrs[i] = NULL;
+		++i;
+	}
+	kheap_get_stats(&stats);
+	assert_eq(stats.nb_trims, old.nb_trims + 1);
+
+	/* Stress: allocations of random sizes, freed in a random order a few times */
+	seed = 42;
+	k = 0;
+	while (k < 4)
+	{
+		i = 0;
+		while (i < 1024)
+		{
+			if (ptrs[i] == NULL)
+			{
+				seed = seed * 1103515245u + 12345u;
+				sizes[i] = (seed >> 8) % ((seed & 0x100) ? 64 : KALLOC_MAX_SIZE + 512);
+				ptrs[i] = kalloc(sizes[i]);
+				assert_neq(ptrs[i], NULL);
+				memset(ptrs[i], (uchar)i, sizes[i]);
+			}
+			++i;
+		}
+		i = 0;
+		while (i < 1024)
+		{
+			seed = seed * 1103515245u + 12345u;
+			if (seed & 0x1000)
+			{
+				j = 0;
+				while (j < sizes[i]) {
+					assert_eq(ptrs[i][j], (uchar)i);
+					++j;
+				}
+				kfree(ptrs[i]);
+				ptrs[i] = NULL;
+			}
+			++i;
+		}
+		++k;
+	}
+
+	i = 0;
+	while (i < 1024) {
+		kfree(ptrs[i]);
+		ptrs[i] = NULL;
+		++i;
+	}
+
+	/* Benchmark: a size class doesn't care about the blocks of the heap first-fit walks through */
+	i = 0;
+	while (i < 256) {
+		ptrs[i] = kalloc(KALLOC_MAX_SIZE + 1);
+		assert_neq(ptrs[i], NULL);
+		++i;
+	}
+	start = get_cycles();
+	i = 0;
+	while (i < 1024) {
+		kfree(kalloc(64));
+		++i;
+	}
+	slab_time = get_cycles() - start;
+	start = get_cycles();
+	i = 0;
+	while (i < 1024) {
+		kfree(kalloc(KALLOC_MAX_SIZE + 1));
+		++i;
+	}
+	heap_time = get_cycles() - start;
+	printf("\r[..]\tkalloc: %u cycles per allocation of a size class, %u of the heap\n",
+		(uint)(slab_time / 1024),
+		(uint)(heap_time / 1024)
+	);
+	assert(slab_time < heap_time);
+	i = 0;
+	while (i < 256) {
+		kfree(ptrs[i]);
+		ptrs[i] = NULL;
+		++i;
+	}
+}
+
+NEW_UNIT_TEST(kalloc, &kalloc_test, UNIT_TEST_LEVEL_VMM);
@@ -0,0 +1,374 @@
+/* ------------------------------------------------------------------------ *\
+**
+**  This file is part of the Chaos Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2017 - Benjamin Grange <benjamin.grange@epitech.eu>
+**
+\* ------------------------------------------------------------------------ */
+
+#include <kernel/kalloc.h>
+
+#ifdef ENABLE_KALLOC_PROFILER
+
+#include <kernel/unit-tests.h>
+#include <stdio.h>
+
+/*
+** Kernel memory profiler.
+**
+** Each allocation is charged to its call site, made of the function calling
+** kalloc() and the one calling it. Sites are kept in a fixed-size hash table,
+** and so are the allocations that aren't freed yet, so that a free is charged
+** back to the site that made the allocation.
+**
+** Nothing here allocates memory: when a table is full, the new sites or
+** allocations are only counted as lost.
+*/
+
+struct kalloc_site
+{
+	void *caller;			/* Function calling kalloc(), or NULL if the entry is empty */
+	void *parent;			/* Function calling 'caller' */
+	size_t nb_allocs;
+	size_t nb_frees;
+	size_t total_bytes;		/* Bytes allocated since boot */
+	size_t live_bytes;		/* Bytes allocated and not freed yet */
+	size_t peak_bytes;		/* Highest value of live_bytes */
+};
+
+struct kalloc_live
+{
+	virt_addr_t ptr;		/* NULL if the entry is empty */
+	struct kalloc_site *site;
+	size_t size;
+};
+
+/* Allocations of up to 2^i bytes are counted in histogram[i] */
+# define NB_BUCKETS		(sizeof(size_t) * 8u)
+
+static struct kalloc_site	sites[KALLOC_PROFILER_SITES];
+static struct kalloc_live	lives[KALLOC_PROFILER_LIVE];
+static size_t			histogram[NB_BUCKETS];
+static size_t			live_bytes;
+static size_t			peak_bytes;
+static size_t			nb_lost_sites;
+static size_t			nb_lost_lives;
+static struct spinlock		profiler_lock;
+
+# define LOCK_PROFILER(state)	LOCK(&profiler_lock, state)
+# define RELEASE_PROFILER(state)	RELEASE(&profiler_lock, state)
+
+static_assert(!(KALLOC_PROFILER_SITES & (KALLOC_PROFILER_SITES - 1)));
+static_assert(!(KALLOC_PROFILER_LIVE & (KALLOC_PROFILER_LIVE - 1)));
+
+static inline size_t
+hash(uintptr value)
+{
+	return ((value >> 3u) * 2654435761u);
+}
+
+/*
+** Returns the entry of the given call site, creating it if needed.
+** Returns NULL if the table is full.
+*/
+static struct kalloc_site *
+find_site(void *caller, void *parent)
+{
+	struct kalloc_site *site;
+	size_t idx;
+	size_t i;
+
+	idx = hash((uintptr)caller ^ ((uintptr)parent << 7u));
+	i = 0;
+	while (i < KALLOC_PROFILER_SITES)
+	{
+		site = sites + ((idx + i) & (KALLOC_PROFILER_SITES - 1));
+		if (site->caller == NULL) {
+			site->caller = caller;
+			site->parent = parent;
+			return (site);
+		}
+		if (site->caller == caller && site->parent == parent) {
+			return (site);
+		}
+		++i;
+	}
+	return (NULL);
+}
+
+/*
+** Returns the entry of the given allocation, or NULL if it isn't followed.
+*/
+static struct kalloc_live *
+find_live(virt_addr_t ptr)
+{
+	struct kalloc_live *live;
+	size_t idx;
+	size_t i;
+
+	idx = hash((uintptr)ptr);
+	i = 0;
+	while (i < KALLOC_PROFILER_LIVE)
+	{
+		live = lives + ((idx + i) & (KALLOC_PROFILER_LIVE - 1));
+		if (live->ptr == ptr) {
+			return (live);
+		} else if (live->ptr == NULL) {
+			break;
+		}
+		++i;
+	}
+	return (NULL);
+}
+
+/*
+** Returns an unused entry to follow the given allocation, or NULL if the table is full.
+*/
+static struct kalloc_live *
+new_live(virt_addr_t ptr)
+{
+	struct kalloc_live *live;
+	size_t idx;
+	size_t i;
+
+	idx = hash((uintptr)ptr);
+	i = 0;
+	while (i < KALLOC_PROFILER_LIVE)
+	{
+		live = lives + ((idx + i) & (KALLOC_PROFILER_LIVE - 1));
+		if (live->ptr == NULL) {
+			return (live);
+		}
+		++i;
+	}
+	return (NULL);
+}
+
+/*
+** Empties the given entry.
+** The entries following it in the same run are shifted back into the hole when
+** it lies between their home slot and theirs, so that every entry can still be
+** reached from its home slot without leaving tombstones behind.
+*/
+static void
+delete_live(struct kalloc_live *live)
+{
+	size_t hole;
+	size_t home;
+	size_t i;
+
+	hole = live - lives;
+	lives[hole].ptr = NULL;
+	i = (hole + 1) & (KALLOC_PROFILER_LIVE - 1);
+	while (lives[i].ptr != NULL)
+	{
+		home = hash((uintptr)lives[i].ptr) & (KALLOC_PROFILER_LIVE - 1);
+		if (((i - home) & (KALLOC_PROFILER_LIVE - 1)) >= ((i - hole) & (KALLOC_PROFILER_LIVE - 1)))
+		{
+			lives[hole] = lives[i];
+			lives[i].ptr = NULL;
+			hole = i;
+		}
+		i = (i + 1) & (KALLOC_PROFILER_LIVE - 1);
+	}
+}
+
+/*
+** Charges an allocation of 'size' bytes at 'ptr' to the given call site.
+*/
+void
+kalloc_profiler_alloc(virt_addr_t ptr, size_t size, void *caller, void *parent)
+{
+	struct kalloc_site *site;
+	struct kalloc_live *live;
+
+	if (ptr == NULL) {
+		return ;
+	}
+
+	LOCK_PROFILER(state);
+	++histogram[size <= 1 ? 0 : sizeof(uint) * 8 - __builtin_clz(size - 1)];
+
+	site = find_site(caller, parent);
+	if (site == NULL) {
+		++nb_lost_sites;
+		RELEASE_PROFILER(state);
+		return ;
+	}
+	++site->nb_allocs;
+	site->total_bytes += size;
+
+	live = new_live(ptr);
+	if (live == NULL) {
+		++nb_lost_lives;
+		RELEASE_PROFILER(state);
+		return ;
+	}
+	live->ptr = ptr;
+	live->site = site;
+	live->size = size;
+	site->live_bytes += size;
+	site->peak_bytes = MAX(site->peak_bytes, site->live_bytes);
+	live_bytes += size;
+	peak_bytes = MAX(peak_bytes, live_bytes);
+	RELEASE_PROFILER(state);
+}
+
+/*
+** Charges the free of the given allocation back to the site that made it.
+** Allocations that aren't followed are ignored.
+*/
+void
+kalloc_profiler_free(virt_addr_t ptr)
+{
+	struct kalloc_live *live;
+
+	if (ptr == NULL) {
+		return ;
+	}
+
+	LOCK_PROFILER(state);
+	live = find_live(ptr);
+	if (live != NULL) {
+		++live->site->nb_frees;
+		live->site->live_bytes -= live->size;
+		live_bytes -= live->size;
+		delete_live(live);
+	}
+	RELEASE_PROFILER(state);
+}
+
+/*
+** Prints the size histogram and the call sites, those holding the most memory first.
+*/
+void
+kalloc_profiler_dump(void)
+{
+	static struct kalloc_site *sorted[KALLOC_PROFILER_SITES];
+	struct kalloc_site *site;
+	size_t nb_sites;
+	size_t i;
+	size_t j;
+
+	LOCK_PROFILER(state);
+	printf("Kernel memory profile: %u bytes in use, %u at peak\n", live_bytes, peak_bytes);
+	if (nb_lost_sites || nb_lost_lives) {
+		printf("\t(%u allocations of unknown sites, %u not followed)\n", nb_lost_sites, nb_lost_lives);
+	}
+
+	printf("Allocations by size:\n");
+	i = 0;
+	while (i < NB_BUCKETS)
+	{
+		if (histogram[i]) {
+			printf("\t<= %-10u %u\n", (size_t)1u << i, histogram[i]);
+		}
+		++i;
+	}
+
+	/* Insertion sort, by decreasing number of bytes in use */
+	nb_sites = 0;
+	i = 0;
+	while (i < KALLOC_PROFILER_SITES)
+	{
+		site = sites + i;
+		if (site->caller != NULL)
+		{
+			j = nb_sites;
+			while (j > 0 && sorted[j - 1]->live_bytes < site->live_bytes) {
+				sorted[j] = sorted[j - 1];
+				--j;
+			}
+			sorted[j] = site;
+			++nb_sites;
+		}
+		++i;
+	}
+
+	printf("%-23s %8s %8s %10s %10s %10s\n", "call site", "allocs", "frees", "live", "peak", "total");
+	i = 0;
+	while (i < nb_sites)
+	{
+		site = sorted[i];
+		printf("%p <- %p %8u %8u %10u %10u %10u\n",
+			site->caller,
+			site->parent,
+			site->nb_allocs,
+			site->nb_frees,
+			site->live_bytes,
+			site->peak_bytes,
+			site->total_bytes
+		);
+		++i;
+	}
+	RELEASE_PROFILER(state);
+}
+
+/*
+** Unit tests function
+*/
+
+static void
+kalloc_profiler_test(void)
+{
+	struct kalloc_site *site;
+	struct kalloc_live *live;
+	size_t old_live;
+	size_t nb_used;
+	size_t i;
+	void *ptr;
+	void *ptr2;
+	uchar *fake;
+
+	old_live = live_bytes;
+	ptr = kalloc(100);
+	ptr2 = kalloc(5000);
+	assert_eq(live_bytes, old_live + 5100);
+	assert_neq(find_live(ptr), NULL);
+	site = find_live(ptr)->site;
+	assert_neq(site, find_live(ptr2)->site);
+	assert_eq(site->live_bytes, 100);
+
+	ptr = krealloc(ptr, 200);
+	assert_eq(find_live(ptr)->size, 200);
+	assert_eq(live_bytes, old_live + 5200);
+
+	kfree(ptr);
+	kfree(ptr2);
+	assert_eq(live_bytes, old_live);
+	assert_eq(find_live(ptr), NULL);
+	assert(peak_bytes >= old_live + 5200);
+
+	/* Freed entries are emptied, and the ones probed past them are still found */
+	nb_used = 0;
+	i = 0;
+	while (i < KALLOC_PROFILER_LIVE) {
+		nb_used += (lives[i].ptr != NULL);
+		++i;
+	}
+	fake = (uchar *)0xDEAD0000;
+	kalloc_profiler_alloc(fake, 1, &kalloc_profiler_test, NULL);
+	kalloc_profiler_alloc(fake + 8 * KALLOC_PROFILER_LIVE, 2, &kalloc_profiler_test, NULL);
+	kalloc_profiler_alloc(fake + 16 * KALLOC_PROFILER_LIVE, 3, &kalloc_profiler_test, NULL);
+	live = find_live(fake);
+	assert_neq(live, NULL);
+	kalloc_profiler_free(fake);
+	assert_eq(find_live(fake), NULL);
+	assert_neq(live->ptr, NULL);
+	assert_eq(find_live(fake + 8 * KALLOC_PROFILER_LIVE)->size, 2);
+	assert_eq(find_live(fake + 16 * KALLOC_PROFILER_LIVE)->size, 3);
+	kalloc_profiler_free(fake + 16 * KALLOC_PROFILER_LIVE);
+	kalloc_profiler_free(fake + 8 * KALLOC_PROFILER_LIVE);
+	assert_eq(live_bytes, old_live);
+	i = 0;
+	while (i < KALLOC_PROFILER_LIVE) {
+		nb_used -= (lives[i].ptr != NULL);
+		++i;
+	}
+	assert_eq(nb_used, 0);
+}
+
+NEW_UNIT_TEST(kalloc_profiler, &kalloc_profiler_test, UNIT_TEST_LEVEL_VMM);
+
+#endif /* ENABLE_KALLOC_PROFILER */
@@ -46,6 +46,9 @@ multiboot_load(void)
 
 	printf("[..]\t Multiboot");
 	memset(&multiboot_infos, 0, sizeof(multiboot_infos));
+	/* The tags follow an 8-bytes header holding the total size of the structure */
+	multiboot_infos.pstart = (uintptr)mb_tag - 8u - (uintptr)KERNEL_VIRTUAL_BASE;
+	multiboot_infos.pend = multiboot_infos.pstart + *(uint32 *)((uchar *)mb_tag - 8u);
 	tag = mb_tag;
 	while (tag->type != MULTIBOOT_TAG_TYPE_END)
 	{
@@ -8,6 +8,7 @@
 \* ------------------------------------------------------------------------ */
 
 #include <kernel/interrupts.h>
+#include <kernel/kalloc.h>
 #include <chaosdef.h>
 #include <stdio.h>
 
@@ -54,6 +55,10 @@ panic(const char *fmt, ...)
 	}
 	while (0);
 
+#ifdef ENABLE_KALLOC_PROFILER
+	kalloc_profiler_dump();
+#endif /* ENABLE_KALLOC_PROFILER */
+
 	for (;;)
 		;
 }
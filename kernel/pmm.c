@@ -15,80 +15,729 @@
 #include <stdio.h>
 
 /*
-** This is a pretty naive frame allocator using a bitmap to memorize which
-** frames are free and which ones are not.
+** This is a frame allocator using a bitmap to memorize which frames are
+** free and which ones are not.
 **
-** It can definitely be optimised, but that's not the point at this moment.
+** A second, smaller bitmap (the summary) holds one bit per 32-bit cell of
+** the frame bitmap, telling if that cell still has a free frame. Looking
+** for a free frame is therefore a walk over the summary followed by a
+** single bit scan in the cell it points to, whatever the fill level of
+** the frame bitmap is.
+**
+** Physically contiguous allocations are done using a buddy system: a block
+** of order n is a naturally aligned group of 2^n frames, and its buddy is
+** the other half of the block of order n + 1 containing it.
+** The frame bitmap is the only source of truth about which frames are free,
+** so freeing a block immediately coalesces it with its free buddies: it
+** becomes available again at any order they allow.
+**
+** Free and used frames are counted as the bitmap changes, globally, for each
+** usable region of memory and for each zone, so that reading them is O(1).
+**
+** Zones split the physical memory by address, and each of them is searched
+** on its own, starting at its own next_frame. Allocations that don't need
+** a specific zone use the normal one, and only fall back to the DMA one
+** when it's exhausted, leaving low memory to the drivers that need it.
+** Zone boundaries are aligned on a cell of the summary bitmaps, so that
+** a cell of the frame bitmap or a buddy block never crosses one.
+**
+** The bitmaps only cover physical memory up to the highest usable address
+** given by the bootloader. They are placed in physical memory right after the
+** kernel when it boots, and are reached through the boot mapping, so that
+** neither the kernel image nor the scans grow with the address space.
+**
+** Each frame also has a descriptor holding a reference count, so that a frame
+** can be shared: freeing it drops a reference, and it's only given back to the
+** allocator when the last one is dropped. The descriptors live next to the
+** bitmaps, and are kept in sync with them by the functions changing the
+** state of frames, the bitmaps remaining the only thing the allocator looks at.
 */
 
-uchar					frame_bitmap[FRAME_BITMAP_SIZE];
-static size_t				next_frame;
+uint32					*frame_bitmap;
+uint32					*frame_summary;
+uint32					*frame_empty;
+size_t					nb_frames;
+static size_t				bitmap_size;
+static size_t				summary_size;
+static struct pmm_zone			zones[NB_ZONES];
+struct page				*pages;
+
+/* Physical memory reserved at boot for the bitmaps and the frame descriptors, inclusive */
+static phys_addr_t			boot_memory_start;
+phys_addr_t				boot_memory_end;
+
+/* Frame counters */
+static size_t				frames_free;
+static struct pmm_region		regions[PMM_MAX_REGIONS];
+static size_t				nb_regions;
 
 /*
-** Allocates a new frame and returns it, or NULL_FRAME if there is no physical
-** memory left.
+** For each order a block may have within a cell of the frame bitmap,
+** the bits where such a naturally aligned block can start.
+*/
+static uint32 const			block_starts[] =
+{
+	0xFFFFFFFFu,
+	0x55555555u,
+	0x11111111u,
+	0x01010101u,
+	0x00010001u,
+	0x00000001u,
+};
+
+/* The order of a block spanning a whole cell of the frame bitmap */
+# define CELL_ORDER			(5u)
+
+/*
+** Returns the index of the least significant bit set in the given value.
+** The value must not be 0.
+*/
+static inline uint
+first_bit_set(uint32 value)
+{
+	return (__builtin_ctz(value));
+}
+
+/*
+** Returns the number of bits set in the given value.
+*/
+static inline uint
+count_bits_set(uint32 value)
+{
+	value = value - ((value >> 1u) & 0x55555555u);
+	value = (value & 0x33333333u) + ((value >> 2u) & 0x33333333u);
+	value = (value + (value >> 4u)) & 0x0F0F0F0Fu;
+	return ((value * 0x01010101u) >> 24u);
+}
+
+/*
+** Returns the bits of the given cell of the frame bitmap that belong to the given region.
+*/
+static uint32
+region_cell_mask(struct pmm_region const *region, size_t idx)
+{
+	size_t first;
+	size_t last;
+	uint32 mask;
+
+	first = idx * FRAME_BITMAP_BITS;
+	last = first + FRAME_BITMAP_BITS;
+	if (region->end <= first || region->start >= last) {
+		return (0u);
+	}
+	mask = FRAME_BITMAP_FULL;
+	if (region->start > first) {
+		mask &= FRAME_BITMAP_FULL << (region->start - first);
+	}
+	if (region->end < last) {
+		mask &= FRAME_BITMAP_FULL >> (last - region->end);
+	}
+	return (mask);
+}
+
+/*
+** Updates the summary bits of the given cell of the frame bitmap.
+*/
+static inline void
+update_frame_summary(size_t idx)
+{
+	if (frame_bitmap[idx] == FRAME_BITMAP_FULL) {
+		frame_summary[GET_SUMMARY_IDX(idx)] &= ~GET_SUMMARY_MASK(idx);
+	} else {
+		frame_summary[GET_SUMMARY_IDX(idx)] |= GET_SUMMARY_MASK(idx);
+	}
+	if (frame_bitmap[idx] == 0u) {
+		frame_empty[GET_SUMMARY_IDX(idx)] |= GET_SUMMARY_MASK(idx);
+	} else {
+		frame_empty[GET_SUMMARY_IDX(idx)] &= ~GET_SUMMARY_MASK(idx);
+	}
+}
+
+/*
+** Returns the zone holding the given frame index, or NULL if there is none.
+*/
+static struct pmm_zone *
+get_zone(size_t frame)
+{
+	struct pmm_zone *zone;
+
+	zone = zones;
+	while (zone < zones + NB_ZONES)
+	{
+		if (frame >= zone->start && frame < zone->end) {
+			return (zone);
+		}
+		++zone;
+	}
+	return (NULL);
+}
+
+/*
+** Sets the given cell of the frame bitmap to a new value, keeping the
+** summaries and the frame counters up to date.
+*/
+static void
+set_frame_cell(size_t idx, uint32 value)
+{
+	struct pmm_region *region;
+	struct pmm_zone *zone;
+	uint32 taken;
+	uint32 freed;
+	uint32 mask;
+	uint diff;
+
+	taken = value & ~frame_bitmap[idx];
+	freed = frame_bitmap[idx] & ~value;
+	if (!taken && !freed) {
+		return ;
+	}
+
+	frames_free += count_bits_set(freed);
+	frames_free -= count_bits_set(taken);
+
+	region = regions;
+	while (region < regions + nb_regions)
+	{
+		mask = region_cell_mask(region, idx);
+		if (mask)
+		{
+			diff = count_bits_set(freed & mask);
+			region->nb_free += diff;
+			region->nb_used -= diff;
+			diff = count_bits_set(taken & mask);
+			region->nb_free -= diff;
+			region->nb_used += diff;
+		}
+		++region;
+	}
+
+	/* A cell never crosses a zone boundary */
+	zone = get_zone(idx * FRAME_BITMAP_BITS);
+	if (zone) {
+		zone->nb_free += count_bits_set(freed);
+		zone->nb_free -= count_bits_set(taken);
+	}
+
+	frame_bitmap[idx] = value;
+	update_frame_summary(idx);
+}
+
+/*
+** Mark a frame as allocated.
+*/
+static inline void
+mark_frame_as_allocated(phys_addr_t frame)
+{
+	assert(IS_PAGE_ALIGNED(frame));
+	assert(frame / PAGE_SIZE < nb_frames);
+	set_frame_cell(GET_FRAME_IDX(frame), frame_bitmap[GET_FRAME_IDX(frame)] | GET_FRAME_MASK(frame));
+	pages[frame / PAGE_SIZE].refcount = 1;
+	pages[frame / PAGE_SIZE].flags = PAGE_RESERVED;
+}
+
+/*
+** Mark a frame as freed.
+*/
+static inline void
+mark_frame_as_free(phys_addr_t frame)
+{
+	assert(IS_PAGE_ALIGNED(frame));
+	assert(frame / PAGE_SIZE < nb_frames);
+	set_frame_cell(GET_FRAME_IDX(frame), frame_bitmap[GET_FRAME_IDX(frame)] & ~GET_FRAME_MASK(frame));
+	pages[frame / PAGE_SIZE].refcount = 0;
+	pages[frame / PAGE_SIZE].flags = 0;
+}
+
+/*
+** Sets the reference count and the flags of the descriptors of the frames
+** whose index is within [start, end).
+*/
+static void
+set_pages(size_t start, size_t end, uint16 refcount, uint8 flags)
+{
+	struct page *page;
+
+	page = pages + start;
+	while (page < pages + end)
+	{
+		page->refcount = refcount;
+		page->flags = flags;
+		++page;
+	}
+}
+
+/*
+** Sets or clears the bits of the given bitmap whose index is within [start, end).
+** The unaligned head and tail are masked, the whole words in between are memset().
+*/
+static void
+fill_bits(uint32 *bitmap, size_t start, size_t end, bool set)
+{
+	size_t first;
+	size_t last;
+	uint32 head;
+	uint32 tail;
+
+	if (start >= end) {
+		return ;
+	}
+	first = start / FRAME_BITMAP_BITS;
+	last = (end - 1) / FRAME_BITMAP_BITS;
+	head = FRAME_BITMAP_FULL << (start % FRAME_BITMAP_BITS);
+	tail = FRAME_BITMAP_FULL >> (FRAME_BITMAP_BITS - 1 - (end - 1) % FRAME_BITMAP_BITS);
+	if (first == last) {
+		head &= tail;
+		tail = head;
+	}
+	bitmap[first] = set ? bitmap[first] | head : bitmap[first] & ~head;
+	bitmap[last] = set ? bitmap[last] | tail : bitmap[last] & ~tail;
+	if (last > first + 1) {
+		memset(bitmap + first + 1, set ? 0xFF : 0x00, (last - first - 1) * sizeof(*bitmap));
+	}
+}
+
+/*
+** Returns the number of free frames whose index is within [start, end).
+*/
+static size_t
+count_free_frames(size_t start, size_t end)
+{
+	size_t idx;
+	size_t last;
+	size_t count;
+	uint32 mask;
+
+	if (start >= end) {
+		return (0);
+	}
+	count = 0;
+	idx = start / FRAME_BITMAP_BITS;
+	last = (end - 1) / FRAME_BITMAP_BITS;
+	while (idx <= last)
+	{
+		mask = FRAME_BITMAP_FULL;
+		if (idx == start / FRAME_BITMAP_BITS) {
+			mask &= FRAME_BITMAP_FULL << (start % FRAME_BITMAP_BITS);
+		}
+		if (idx == last) {
+			mask &= FRAME_BITMAP_FULL >> (FRAME_BITMAP_BITS - 1 - (end - 1) % FRAME_BITMAP_BITS);
+		}
+		count += count_bits_set(~frame_bitmap[idx] & mask);
+		++idx;
+	}
+	return (count);
+}
+
+/*
+** Marks all the frames whose index is within [start, end) as allocated or free.
 **
-** The idea is that next_frame contains the index in frame_bitmap of our first
-** looking address, the one most likely to be free.
-** The search is done in two steps, the first one from next_frame to NB_FRAMES, and
-** the second one from 0 to next_frame. If after these two steps no
-** free frame was found, then NULL_FRAME is returned. In the other case,
-** it also sets next_frame to the index of the following address.
+** Unlike set_frame_cell(), the counters are updated once for the whole range, knowing
+** the state every frame ends up in, and the cells strictly inside the range are
+** written, along with their summary bits, with memset().
 */
-phys_addr_t
-alloc_frame(void)
+static void
+set_frame_range(size_t start, size_t end, bool allocated)
 {
-	size_t i;
-	size_t j;
-	size_t final;
-	bool pass;
-
-	i = next_frame;
-	final = FRAME_BITMAP_SIZE;
-	pass = false;
-look_for_address:
-	while (i < final)
-	{
-		if (frame_bitmap[i] != 0xFFu) {
-			j = 0u;
-			while (j < 7u && (frame_bitmap[i] & (1 << j)) != 0) {
-				++j;
+	struct pmm_region *region;
+	struct pmm_zone *zone;
+	size_t rstart;
+	size_t rend;
+	size_t nb_free;
+	size_t first;
+	size_t last;
+
+	if (start >= end) {
+		return ;
+	}
+	assert(end <= nb_frames);
+
+	region = regions;
+	while (region < regions + nb_regions)
+	{
+		rstart = MAX(start, region->start);
+		rend = MIN(end, region->end);
+		if (rstart < rend)
+		{
+			nb_free = count_free_frames(rstart, rend);
+			if (allocated) {
+				region->nb_free -= nb_free;
+				region->nb_used += nb_free;
+			} else {
+				region->nb_free += (rend - rstart) - nb_free;
+				region->nb_used -= (rend - rstart) - nb_free;
 			}
-			frame_bitmap[i] |= (1 << j);
-			next_frame = i;
-			return (PAGE_SIZE * (i * 8u + j));
 		}
-		++i;
+		++region;
 	}
-	if (!pass)
+	zone = zones;
+	while (zone < zones + NB_ZONES)
 	{
-		final = next_frame;
-		i = 0;
-		pass = true;
-		goto look_for_address;
+		rstart = MAX(start, zone->start);
+		rend = MIN(end, zone->end);
+		if (rstart < rend)
+		{
+			nb_free = count_free_frames(rstart, rend);
+			if (allocated) {
+				zone->nb_free -= nb_free;
+			} else {
+				zone->nb_free += (rend - rstart) - nb_free;
+			}
+		}
+		++zone;
 	}
-	return (NULL_FRAME);
+	nb_free = count_free_frames(start, end);
+	if (allocated) {
+		frames_free -= nb_free;
+	} else {
+		frames_free += (end - start) - nb_free;
+	}
+
+	fill_bits(frame_bitmap, start, end, allocated);
+	first = start / FRAME_BITMAP_BITS;
+	last = (end - 1) / FRAME_BITMAP_BITS;
+	update_frame_summary(first);
+	update_frame_summary(last);
+	fill_bits(frame_summary, first + 1, last, !allocated);
+	fill_bits(frame_empty, first + 1, last, !allocated);
+}
+
+/*
+** Given a bitmap where set bits are free, returns the bits starting a free and
+** naturally aligned block of 2^order bits. The order must not exceed CELL_ORDER.
+*/
+static inline uint32
+find_free_blocks(uint32 free, uint order)
+{
+	uint shift;
+
+	shift = 1u;
+	while (shift < (1u << order))
+	{
+		free &= free >> shift;
+		shift <<= 1u;
+	}
+	return (free & block_starts[order]);
 }
 
 /*
-** Frees a given frame.
+** Looks for the first free frame whose index is within [start, end).
+** Returns its index, or 'end' if there is none.
+*/
+static size_t
+find_free_frame(size_t start, size_t end)
+{
+	size_t idx;
+	size_t sidx;
+	size_t send;
+	size_t frame;
+	uint32 bits;
+
+	if (start >= end) {
+		return (end);
+	}
+
+	/* Look in the cell holding 'start' first, ignoring the frames before it */
+	idx = start / FRAME_BITMAP_BITS;
+	bits = ~frame_bitmap[idx] & (FRAME_BITMAP_FULL << (start % FRAME_BITMAP_BITS));
+	if (!bits)
+	{
+		/* Use the summary to find the next cell with a free frame */
+		++idx;
+		if (idx >= bitmap_size) {
+			return (end);
+		}
+		sidx = GET_SUMMARY_IDX(idx);
+		send = GET_SUMMARY_IDX((end - 1) / FRAME_BITMAP_BITS);
+		bits = frame_summary[sidx] & (FRAME_BITMAP_FULL << (idx % FRAME_BITMAP_BITS));
+		while (!bits)
+		{
+			++sidx;
+			if (sidx > send) {
+				return (end);
+			}
+			bits = frame_summary[sidx];
+		}
+		idx = sidx * FRAME_BITMAP_BITS + first_bit_set(bits);
+		bits = ~frame_bitmap[idx];
+	}
+	frame = idx * FRAME_BITMAP_BITS + first_bit_set(bits);
+	return (frame < end ? frame : end);
+}
+
+/*
+** Looks for a free frame within the given zone.
+**
+** The idea is that the zone's next_frame contains the index of our first
+** looking frame, the one most likely to be free.
+** The search is done in two steps, the first one from next_frame to the end of
+** the zone, and the second one from the start of the zone to next_frame.
+** Returns the index of the frame, or the end of the zone if there is none.
+*/
+static size_t
+find_zone_frame(struct pmm_zone const *zone)
+{
+	size_t frame;
+
+	frame = find_free_frame(zone->next_frame, zone->end);
+	if (frame == zone->end)
+	{
+		frame = find_free_frame(zone->start, zone->next_frame);
+		if (frame == zone->next_frame) {
+			return (zone->end);
+		}
+	}
+	return (frame);
+}
+
+/*
+** Takes an other reference to the given frame, which must be taken.
 */
 void
-free_frame(phys_addr_t frame)
+get_page(phys_addr_t frame)
 {
-	/* Ensure the address is page-aligned */
-	assert(IS_PAGE_ALIGNED(frame));
+	struct page *page;
+
+	page = phys_to_page(frame);
+	assert(page->refcount > 0);
+	assert(page->refcount < PAGE_MAX_REFCOUNT);
+	++page->refcount;
+}
+
+/*
+** Drops a reference to the given frame, freeing it if it was the last one.
+*/
+void
+put_page(phys_addr_t frame)
+{
+	struct page *page;
+	struct pmm_zone *zone;
 
 	/* Ensure the given physical address is taken */
 	assert(is_frame_allocated(frame));
+	page = phys_to_page(frame);
+	assert(page->refcount > 0);
+
+	--page->refcount;
+	if (page->refcount == 0)
+	{
+		/* Set the bit corresponding to this frame to 0 */
+		mark_frame_as_free(frame);
+		zone = get_zone(frame / PAGE_SIZE);
+		if (zone) {
+			zone->next_frame = frame / PAGE_SIZE;
+		}
+	}
+}
+
+/*
+** Frees a given frame, or rather drops a reference to it: the frame is only
+** freed if that was the last one.
+*/
+void
+free_frame(phys_addr_t frame)
+{
+	put_page(frame);
+}
+
+/*
+** Marks the block of 2^order frames starting at the given frame index
+** as allocated or free.
+*/
+static void
+mark_block(size_t frame, uint order, bool allocated)
+{
+	size_t idx;
+	size_t end;
+	uint32 mask;
+
+	idx = frame / FRAME_BITMAP_BITS;
+	if (order < CELL_ORDER)
+	{
+		mask = ((1u << (1u << order)) - 1u) << (frame % FRAME_BITMAP_BITS);
+		if (allocated) {
+			set_frame_cell(idx, frame_bitmap[idx] | mask);
+		} else {
+			set_frame_cell(idx, frame_bitmap[idx] & ~mask);
+		}
+	}
+	else
+	{
+		end = idx + (1u << (order - CELL_ORDER));
+		while (idx < end)
+		{
+			set_frame_cell(idx, allocated ? FRAME_BITMAP_FULL : 0u);
+			++idx;
+		}
+	}
+}
+
+/*
+** Looks for a free block made of whole cells of the frame bitmap within the given zone.
+** Returns the index of the first frame of the block, or the end of the zone.
+*/
+static size_t
+find_big_block(struct pmm_zone const *zone, uint order)
+{
+	size_t sidx;
+	uint32 blocks;
+
+	sidx = zone->start / FRAME_SUMMARY_FRAMES;
+	while (sidx < zone->end / FRAME_SUMMARY_FRAMES)
+	{
+		blocks = find_free_blocks(frame_empty[sidx], order - CELL_ORDER);
+		if (blocks) {
+			return ((sidx * FRAME_BITMAP_BITS + first_bit_set(blocks)) * FRAME_BITMAP_BITS);
+		}
+		++sidx;
+	}
+	return (zone->end);
+}
+
+/*
+** Looks for a free block smaller than a cell of the frame bitmap within the given zone.
+**
+** Cells that are already partially used are looked at first, so that
+** empty cells are only split when there is no other choice, keeping them
+** available for bigger blocks.
+** Returns the index of the first frame of the block, or the end of the zone.
+*/
+static size_t
+find_small_block(struct pmm_zone const *zone, uint order)
+{
+	size_t sidx;
+	size_t idx;
+	uint32 cells;
+	uint32 blocks;
+
+	sidx = zone->start / FRAME_SUMMARY_FRAMES;
+	while (sidx < zone->end / FRAME_SUMMARY_FRAMES)
+	{
+		cells = frame_summary[sidx] & ~frame_empty[sidx];
+		while (cells)
+		{
+			idx = sidx * FRAME_BITMAP_BITS + first_bit_set(cells);
+			blocks = find_free_blocks(~frame_bitmap[idx], order);
+			if (blocks) {
+				return (idx * FRAME_BITMAP_BITS + first_bit_set(blocks));
+			}
+			cells &= cells - 1u;
+		}
+		++sidx;
+	}
+	return (find_big_block(zone, CELL_ORDER));
+}
+
+/*
+** Allocates a block of 2^order physically contiguous frames, aligned on its size,
+** in the given zone or, if it's exhausted, in the zones below it.
+**
+** A zone only serves allocations falling back from an other zone as long as
+** it has more free frames than its watermark.
+** Returns the address of the first frame, or NULL_FRAME if there is no such
+** block available.
+*/
+phys_addr_t
+alloc_frames_zone(uint order, enum zone_type type)
+{
+	struct pmm_zone *zone;
+	size_t reserve;
+	size_t frame;
+	int i;
+
+	assert(type < NB_ZONES);
+	if (order > PMM_MAX_ORDER) {
+		return (NULL_FRAME);
+	}
+
+	i = (int)type;
+	while (i >= 0)
+	{
+		zone = zones + i;
+		reserve = (i == (int)type) ? 0 : zone->watermark;
+		if (zone->nb_free >= reserve + (1u << order))
+		{
+			if (order == 0) {
+				frame = find_zone_frame(zone);
+			} else if (order < CELL_ORDER) {
+				frame = find_small_block(zone, order);
+			} else {
+				frame = find_big_block(zone, order);
+			}
+			if (frame != zone->end)
+			{
+				mark_block(frame, order, true);
+				set_pages(frame, frame + (1u << order), 1, 0);
+				if (order == 0) {
+					zone->next_frame = frame;
+				}
+				return (frame * PAGE_SIZE);
+			}
+		}
+		--i;
+	}
+	return (NULL_FRAME);
+}
+
+/*
+** Allocates a new frame in the given zone, or in the zones below it.
+** Returns NULL_FRAME if there is none left.
+*/
+phys_addr_t
+alloc_frame_zone(enum zone_type type)
+{
+	return (alloc_frames_zone(0, type));
+}
+
+/*
+** Allocates a new frame and returns it, or NULL_FRAME if there is no physical
+** memory left.
+*/
+phys_addr_t
+alloc_frame(void)
+{
+	return (alloc_frames_zone(0, ZONE_NORMAL));
+}
+
+/*
+** Allocates a block of 2^order physically contiguous frames, aligned on its size.
+** Returns the address of the first frame, or NULL_FRAME if there is no such
+** block available.
+*/
+phys_addr_t
+alloc_frames(uint order)
+{
+	return (alloc_frames_zone(order, ZONE_NORMAL));
+}
+
+/*
+** Frees a block of 2^order frames allocated with alloc_frames().
+*/
+void
+free_frames(phys_addr_t pa, uint order)
+{
+	size_t frame;
+	size_t i;
+
+	assert(order <= PMM_MAX_ORDER);
+	assert_eq(ROUND_DOWN(pa, PAGE_SIZE << order), pa);
 
-	/* Set the bit corresponding to this frame to 0 */
-	frame_bitmap[GET_FRAME_IDX(frame)] &= ~(GET_FRAME_MASK(frame));
-	next_frame = GET_FRAME_IDX(frame);
+	frame = pa / PAGE_SIZE;
+
+	/* Ensure the whole block is taken, and isn't shared */
+	i = 0;
+	while (i < (1u << order))
+	{
+		assert(is_frame_allocated((frame + i) * PAGE_SIZE));
+		assert_eq(pages[frame + i].refcount, 1);
+		++i;
+	}
+	set_pages(frame, frame + (1u << order), 0, 0);
+	mark_block(frame, order, false);
 }
 
 /*
-** Mark a range of frames as allocated.
+** Mark a range of frames as allocated. The end of the range is inclusive.
+** The part of the range that is beyond the bitmap is ignored, as it is always taken.
 */
 void
 mark_range_as_allocated(phys_addr_t start, phys_addr_t end)
@@ -96,56 +745,281 @@ mark_range_as_allocated(phys_addr_t start, phys_addr_t end)
 	assert(IS_PAGE_ALIGNED(start));
 	assert(IS_PAGE_ALIGNED(end));
 
-	while (start <= end)
-	{
-		mark_frame_as_allocated(start);
-		start += PAGE_SIZE;
-	}
+	set_frame_range(start / PAGE_SIZE, MIN(end / PAGE_SIZE + 1, nb_frames), true);
+	set_pages(start / PAGE_SIZE, MIN(end / PAGE_SIZE + 1, nb_frames), 1, PAGE_RESERVED);
 }
 
 /*
-** Mark a range of frames as freed.
+** Mark a range of frames as freed. The end of the range is inclusive.
+** The part of the range that is beyond the bitmap is ignored.
 */
 void
 mark_range_as_free(phys_addr_t start, phys_addr_t end)
 {
+	struct pmm_zone *zone;
+
 	assert(IS_PAGE_ALIGNED(start));
 	assert(IS_PAGE_ALIGNED(end));
 
-	while (start <= end)
-	{
-		mark_frame_as_free(start);
-		start += PAGE_SIZE;
+	zone = get_zone(start / PAGE_SIZE);
+	if (zone) {
+		zone->next_frame = start / PAGE_SIZE;
 	}
-	next_frame = start;
+	set_frame_range(start / PAGE_SIZE, MIN(end / PAGE_SIZE + 1, nb_frames), false);
+	set_pages(start / PAGE_SIZE, MIN(end / PAGE_SIZE + 1, nb_frames), 0, 0);
 }
 
 /*
-** Calculates the amount of free frames
+** Returns the amount of free frames.
 */
 size_t
 nb_free_frames(void)
 {
+	return (frames_free);
+}
+
+/*
+** Fills the given structure with a snapshot of the physical memory state.
+**
+** Unlike the counters, the largest run of free frames isn't kept up to date,
+** and is computed by walking the bitmap, skipping full cells thanks to the summary.
+*/
+void
+pmm_get_stats(struct pmm_stats *stats)
+{
+	size_t idx;
+	size_t run;
+	uint32 bits;
+	uint i;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->nb_free = frames_free;
+	stats->nb_regions = nb_regions;
+	memcpy(stats->regions, regions, nb_regions * sizeof(*regions));
+	memcpy(stats->zones, zones, sizeof(zones));
+	for (i = 0; i < nb_regions; ++i) {
+		stats->nb_used += regions[i].nb_used;
+	}
+
+	run = 0;
+	idx = 0;
+	while (idx < bitmap_size)
+	{
+		if (frame_summary[GET_SUMMARY_IDX(idx)] == 0u && idx % FRAME_BITMAP_BITS == 0u) {
+			run = 0;
+			idx += FRAME_BITMAP_BITS;
+			continue;
+		}
+		bits = frame_bitmap[idx];
+		if (bits == 0u) {
+			run += FRAME_BITMAP_BITS;
+		} else if (bits == FRAME_BITMAP_FULL) {
+			run = 0;
+		} else {
+			for (i = 0; i < FRAME_BITMAP_BITS; ++i)
+			{
+				if (bits & (1u << i)) {
+					run = 0;
+				} else {
+					++run;
+					if (run > stats->largest_free_run) {
+						stats->largest_free_run = run;
+					}
+				}
+			}
+		}
+		if (run > stats->largest_free_run) {
+			stats->largest_free_run = run;
+		}
+		++idx;
+	}
+}
+
+/*
+** Counts again all the free frames, globally, for each region and for each
+** zone, using the bitmap only, and compares the result with the live counters.
+** The summary bits of each cell and the frame descriptors are checked along the way.
+**
+** Returns OK if they match, ERR_BAD_STATE otherwise.
+*/
+status_t
+pmm_audit(void)
+{
+	size_t idx;
+	size_t nb_free;
+	size_t region_free[PMM_MAX_REGIONS];
+	uint32 free;
+	uint i;
+
+	nb_free = 0;
+	memset(region_free, 0, sizeof(region_free));
+	idx = 0;
+	while (idx < bitmap_size)
+	{
+		free = ~frame_bitmap[idx];
+		nb_free += count_bits_set(free);
+		if (!(frame_summary[GET_SUMMARY_IDX(idx)] & GET_SUMMARY_MASK(idx)) != !free
+			|| !(frame_empty[GET_SUMMARY_IDX(idx)] & GET_SUMMARY_MASK(idx)) != (free != FRAME_BITMAP_FULL)) {
+			return (ERR_BAD_STATE);
+		}
+		for (i = 0; i < FRAME_BITMAP_BITS; ++i)
+		{
+			if (!pages[idx * FRAME_BITMAP_BITS + i].refcount != !!(free & (1u << i))) {
+				return (ERR_BAD_STATE);
+			}
+		}
+		for (i = 0; i < nb_regions; ++i) {
+			region_free[i] += count_bits_set(free & region_cell_mask(regions + i, idx));
+		}
+		++idx;
+	}
+
+	if (nb_free != frames_free) {
+		return (ERR_BAD_STATE);
+	}
+	for (i = 0; i < nb_regions; ++i)
+	{
+		if (region_free[i] != regions[i].nb_free
+			|| regions[i].nb_free + regions[i].nb_used != regions[i].end - regions[i].start) {
+			return (ERR_BAD_STATE);
+		}
+	}
+	for (i = 0; i < NB_ZONES; ++i)
+	{
+		if (zones[i].nb_free != count_free_frames(zones[i].start, zones[i].end)) {
+			return (ERR_BAD_STATE);
+		}
+	}
+	return (OK);
+}
+
+/*
+** Adds a usable region of memory, given as a range of frame indexes, to the
+** region table, keeping it sorted. All the frames of the region must be taken.
+**
+** Returns false if the region was ignored.
+*/
+static bool
+add_region(size_t start, size_t end)
+{
+	struct pmm_region *region;
+
+	if (start >= end) {
+		return (false);
+	}
+	if (nb_regions == PMM_MAX_REGIONS) {
+		printf("[..]\tPMM: too many memory regions, ignoring [%#p, %#p)\n",
+			start * PAGE_SIZE, end * PAGE_SIZE);
+		return (false);
+	}
+	region = regions + nb_regions;
+	while (region > regions && region[-1].start > start)
+	{
+		region[0] = region[-1];
+		--region;
+	}
+	region->start = start;
+	region->end = end;
+	region->nb_free = 0;
+	region->nb_used = region->end - region->start;
+	++nb_regions;
+	return (true);
+}
+
+/*
+** Splits the physical memory in zones, the DMA one ending at the given frame index,
+** and counts their free frames.
+**
+** Each zone keeps a quarter of the frames free at that time to the allocations
+** targeting it, so that falling back to a lower zone doesn't exhaust it.
+*/
+static void
+setup_zones(size_t dma_end)
+{
+	struct pmm_zone *zone;
 	size_t i;
-	size_t nb;
 
-	i = 0;
-	nb = 0;
-	while (i < FRAME_BITMAP_SIZE)
-	{
-		if (frame_bitmap[i] != 0xFF) {
-			nb += !(bool)(frame_bitmap[i] & (1 << 0));
-			nb += !(bool)(frame_bitmap[i] & (1 << 1));
-			nb += !(bool)(frame_bitmap[i] & (1 << 2));
-			nb += !(bool)(frame_bitmap[i] & (1 << 3));
-			nb += !(bool)(frame_bitmap[i] & (1 << 4));
-			nb += !(bool)(frame_bitmap[i] & (1 << 5));
-			nb += !(bool)(frame_bitmap[i] & (1 << 6));
-			nb += !(bool)(frame_bitmap[i] & (1 << 7));
+	assert(dma_end % FRAME_SUMMARY_FRAMES == 0);
+	assert(dma_end <= nb_frames);
+
+	zones[ZONE_DMA].start = 0;
+	zones[ZONE_DMA].end = dma_end;
+	zones[ZONE_NORMAL].start = dma_end;
+	zones[ZONE_NORMAL].end = nb_frames;
+
+	zone = zones;
+	while (zone < zones + NB_ZONES)
+	{
+		zone->nb_free = count_free_frames(zone->start, zone->end);
+		zone->watermark = zone->nb_free / 4u;
+		zone->next_frame = zone->start;
+		for (i = zone->start; i < zone->end; ++i) {
+			pages[i].zone = zone - zones;
 		}
-		++i;
+		++zone;
+	}
+}
+
+/*
+** Gives the range of usable memory of the given entry of the memory map, clipped to the
+** physical address space. Only frames that are entirely within the entry are usable.
+*/
+static void
+get_mmap_entry_range(multiboot_memory_map_t const *mmap, uint64 *start, uint64 *end)
+{
+	*start = (mmap->addr + PAGE_SIZE_MASK) & ~(uint64)PAGE_SIZE_MASK;
+	*end = (mmap->addr + mmap->len) & ~(uint64)PAGE_SIZE_MASK;
+	if (*end > (uint64)NB_FRAMES * PAGE_SIZE) {
+		*end = (uint64)NB_FRAMES * PAGE_SIZE;
+	}
+}
+
+/*
+** Returns true if the range [start, start + size) overlaps [ostart, oend).
+*/
+static inline bool
+ranges_overlap(uint64 start, size_t size, uint64 ostart, uint64 oend)
+{
+	return (start < oend && ostart < start + size);
+}
+
+/*
+** Looks for 'size' bytes of usable physical memory after the kernel that are
+** reachable through the boot mapping, skipping the initrd and the multiboot structure.
+** Returns the physical address of that memory, or NULL_FRAME.
+*/
+static phys_addr_t
+find_boot_memory(size_t size)
+{
+	multiboot_memory_map_t *mmap;
+	struct initrd_infos const *initrd;
+	uint64 start;
+	uint64 end;
+	uint64 pa;
+
+	initrd = &multiboot_infos.initrd;
+	mmap = multiboot_infos.mmap;
+	while (mmap < multiboot_infos.mmap_end)
+	{
+		if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE)
+		{
+			get_mmap_entry_range(mmap, &start, &end);
+			end = MIN(end, (uint64)ARCH_BOOT_MAPPING_SIZE);
+			pa = MAX(start, (uint64)KERNEL_PHYSICAL_END + PAGE_SIZE);
+			while (pa + size <= end)
+			{
+				if (initrd->present && ranges_overlap(pa, size, initrd->pstart, initrd->pend + PAGE_SIZE)) {
+					pa = initrd->pend + PAGE_SIZE;
+				} else if (ranges_overlap(pa, size, multiboot_infos.pstart, multiboot_infos.pend)) {
+					pa = ALIGN(multiboot_infos.pend, PAGE_SIZE);
+				} else {
+					return (pa);
+				}
+			}
+		}
+		mmap = (multiboot_memory_map_t *)((uchar *)mmap + multiboot_infos.mmap_entry_size);
 	}
-	return (nb);
+	return (NULL_FRAME);
 }
 
 /*
@@ -155,27 +1029,36 @@ static void
 pmm_reset(void)
 {
 	multiboot_memory_map_t *mmap;
-
-	next_frame = 0u;
+	uint64 start;
+	uint64 end;
 
 	/* Mark everything as allocated */
-	memset(frame_bitmap, 0xFF, sizeof(frame_bitmap));
+	memset(zones, 0, sizeof(zones));
+	memset(frame_bitmap, 0xFF, bitmap_size * sizeof(*frame_bitmap));
+	memset(frame_summary, 0x00, summary_size * sizeof(*frame_summary));
+	memset(frame_empty, 0x00, summary_size * sizeof(*frame_empty));
+	set_pages(0, nb_frames, 1, PAGE_RESERVED);
+	frames_free = 0;
+	nb_regions = 0;
 
-	/* Parse the multiboot structure to mark memory areas that aren't available */
+	/* Parse the multiboot structure to mark memory areas that are available. */
 	mmap = multiboot_infos.mmap;
 	while (mmap < multiboot_infos.mmap_end)
 	{
-		if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
-			mark_range_as_free(
-				ROUND_DOWN(mmap->addr, PAGE_SIZE),
-				ALIGN(mmap->addr + mmap->len, PAGE_SIZE)
-			);
+		if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE)
+		{
+			get_mmap_entry_range(mmap, &start, &end);
+			end = MIN(end, (uint64)nb_frames * PAGE_SIZE);
+			if (start < end && add_region(start / PAGE_SIZE, end / PAGE_SIZE)) {
+				mark_range_as_free(start, end - PAGE_SIZE);
+			}
 		}
 		mmap = (multiboot_memory_map_t *)((uchar *)mmap + multiboot_infos.mmap_entry_size);
 	}
 
-	/* Mark the kernel as allocated */
+	/* Mark the kernel, the bitmaps and the frame descriptors as allocated */
 	mark_range_as_allocated(0, KERNEL_PHYSICAL_END);
+	mark_range_as_allocated(boot_memory_start, boot_memory_end);
 
 	/* Mark the initrd as allocated */
 	if (multiboot_infos.initrd.present) {
@@ -183,40 +1066,483 @@ pmm_reset(void)
 		assert(IS_PAGE_ALIGNED(multiboot_infos.initrd.pend));
 		mark_range_as_allocated(multiboot_infos.initrd.pstart, multiboot_infos.initrd.pend);
 	}
+
+	/* Mark the multiboot structure as allocated, as the memory map is read again after the unit tests */
+	if (multiboot_infos.pend > multiboot_infos.pstart) {
+		mark_range_as_allocated(
+			ROUND_DOWN(multiboot_infos.pstart, PAGE_SIZE),
+			ALIGN(multiboot_infos.pend, PAGE_SIZE) - PAGE_SIZE
+		);
+	}
+
+	setup_zones(MIN(PMM_DMA_LIMIT / PAGE_SIZE, nb_frames));
+}
+
+/*
+** Returns the size of the data structures of the PMM for the current number of frames.
+*/
+static size_t
+get_boot_memory_size(void)
+{
+	bitmap_size = nb_frames / FRAME_BITMAP_BITS;
+	summary_size = bitmap_size / FRAME_BITMAP_BITS;
+	return ((bitmap_size + 2 * summary_size) * sizeof(uint32) + nb_frames * sizeof(struct page));
 }
 
 /*
 ** Initializes the frame allocator.
+**
+** The bitmaps and the frame descriptors are sized to the highest usable frame,
+** rounded up so that the summaries have no partial cell, and placed in memory
+** reserved at boot. If they don't fit in the boot mapping, the memory at the
+** top is left alone.
 */
 static void
 pmm_init(enum init_level il __unused)
 {
+	multiboot_memory_map_t *mmap;
+	uint64 start;
+	uint64 end;
+	size_t total;
+	size_t size;
+	phys_addr_t pa;
+
+	nb_frames = 0;
+	mmap = multiboot_infos.mmap;
+	while (mmap < multiboot_infos.mmap_end)
+	{
+		if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE)
+		{
+			get_mmap_entry_range(mmap, &start, &end);
+			if (start < end) {
+				nb_frames = MAX(nb_frames, (size_t)(end / PAGE_SIZE));
+			}
+		}
+		mmap = (multiboot_memory_map_t *)((uchar *)mmap + multiboot_infos.mmap_entry_size);
+	}
+	if (nb_frames == 0) {
+		panic("PMM: No usable memory");
+	}
+	nb_frames = ALIGN(nb_frames, FRAME_SUMMARY_FRAMES);
+	total = nb_frames;
+
+	size = get_boot_memory_size();
+	pa = find_boot_memory(size);
+	while (pa == NULL_FRAME)
+	{
+		if (nb_frames == FRAME_SUMMARY_FRAMES) {
+			panic("PMM: Not enough memory after the kernel to hold the frame bitmap (%r)", size);
+		}
+		nb_frames -= FRAME_SUMMARY_FRAMES;
+		size = get_boot_memory_size();
+		pa = find_boot_memory(size);
+	}
+	if (nb_frames != total) {
+		printf("[..]\tPMM: Only the first %r of physical memory are used\n", nb_frames * PAGE_SIZE);
+	}
+
+	frame_bitmap = (uint32 *)((uchar *)KERNEL_VIRTUAL_BASE + pa);
+	frame_summary = frame_bitmap + bitmap_size;
+	frame_empty = frame_summary + summary_size;
+	pages = (struct page *)(frame_empty + summary_size);
+	boot_memory_start = pa;
+	boot_memory_end = pa + ALIGN(size, PAGE_SIZE) - PAGE_SIZE;
+
 	pmm_reset();
 	printf("[OK]\tPhysical Memory Managment (Size: %r)\n", (multiboot_infos.mem_stop - multiboot_infos.mem_start) * 1024u);
 }
 
+/*
+** Marks the whole physical memory as free or taken, forgetting about the
+** memory regions, and puts it all in the normal zone.
+** Used by the unit tests, pmm_reset() restores the real state.
+*/
+static void
+pmm_test_reset(bool free)
+{
+	memset(zones, 0, sizeof(zones));
+	nb_regions = 0;
+	set_frame_range(0, nb_frames, !free);
+	set_pages(0, nb_frames, free ? 0 : 1, free ? 0 : PAGE_RESERVED);
+	setup_zones(0);
+}
+
+/*
+** Reference frame allocator used by the unit tests.
+**
+** It looks for the first free frame starting at 'hint' and wrapping around,
+** testing one frame at a time, like the historical allocator did.
+*/
+static phys_addr_t
+pmm_test_reference_alloc(size_t hint)
+{
+	size_t i;
+
+	i = hint;
+	while (i < nb_frames)
+	{
+		if (!is_frame_allocated(i * PAGE_SIZE)) {
+			return (i * PAGE_SIZE);
+		}
+		++i;
+	}
+	i = 0;
+	while (i < hint)
+	{
+		if (!is_frame_allocated(i * PAGE_SIZE)) {
+			return (i * PAGE_SIZE);
+		}
+		++i;
+	}
+	return (NULL_FRAME);
+}
+
+/*
+** Fragments the physical memory and allocates frames until there is none left,
+** ensuring each one is the frame the reference allocator would have returned.
+*/
+static void
+pmm_test_exhaust(void)
+{
+	size_t i;
+	size_t hint;
+	phys_addr_t expected;
+	phys_addr_t frame;
+
+	pmm_test_reset(true);
+
+	/* Punch a pattern of holes, leaving some fully taken cells */
+	i = 0;
+	while (i < nb_frames)
+	{
+		if ((i * 7) % 13 < 5 || (i / FRAME_BITMAP_BITS) % 17 == 3) {
+			mark_frame_as_allocated(i * PAGE_SIZE);
+		}
+		++i;
+	}
+
+	/* Start in the middle of memory to go through the wrap-around */
+	hint = nb_frames / 2 + 3;
+	zones[ZONE_NORMAL].next_frame = hint;
+	do
+	{
+		expected = pmm_test_reference_alloc(hint);
+		frame = alloc_frame();
+		assert_eq(frame, expected);
+		hint = frame / PAGE_SIZE;
+	}
+	while (frame != NULL_FRAME);
+
+	i = 0;
+	while (i < summary_size)
+	{
+		assert_eq(frame_summary[i], 0);
+		++i;
+	}
+}
+
+/*
+** Some unit tests for the buddy allocator.
+*/
+static void
+pmm_test_buddy(void)
+{
+	pmm_test_reset(true);
+
+	/* Blocks are aligned on their size */
+	assert_eq(alloc_frames(0), 0x0000);
+	assert_eq(alloc_frames(1), 0x2000);
+	assert_eq(alloc_frames(2), 0x4000);
+	assert_eq(alloc_frames(1), 0x8000);
+	assert_eq(alloc_frames(5), 0x20000);
+	assert_eq(alloc_frames(PMM_MAX_ORDER), 0x400000);
+	assert_eq(alloc_frames(PMM_MAX_ORDER + 1), NULL_FRAME);
+
+	/* Small blocks are taken from partially used cells first */
+	assert_eq(alloc_frames(3), 0x10000);
+	assert_eq(alloc_frames(4), 0x40000);
+
+	/* Freed blocks coalesce with their buddies */
+	free_frames(0x400000, PMM_MAX_ORDER - 1);
+	assert_eq(alloc_frames(PMM_MAX_ORDER), 0x800000);
+	free_frames(0x600000, PMM_MAX_ORDER - 1);
+	assert_eq(alloc_frames(PMM_MAX_ORDER), 0x400000);
+	free_frames(0x2000, 1);
+	free_frame(0x0000);
+	free_frames(0x4000, 2);
+	free_frames(0x8000, 1);
+	assert(!is_frame_allocated(0x0000));
+	assert(!is_frame_allocated(0xA000));
+
+	/* Frames freed one by one coalesce too */
+	while (alloc_frame() != NULL_FRAME);
+	assert_eq(alloc_frames(1), NULL_FRAME);
+	free_frame(0x1000);
+	free_frame(0x3000);
+	assert_eq(alloc_frames(1), NULL_FRAME);
+	free_frame(0x2000);
+	assert_eq(alloc_frames(1), 0x2000);
+	assert_eq(alloc_frames(1), NULL_FRAME);
+	free_frame(0x0000);
+	assert_eq(alloc_frames(1), 0x0000);
+	assert_eq(alloc_frames(0), NULL_FRAME);
+}
+
+/*
+** Some unit tests for the frame counters.
+*/
+static void
+pmm_test_stats(void)
+{
+	struct pmm_stats stats;
+
+	pmm_test_reset(false);
+	assert(add_region(16, 100));
+	assert(add_region(2, 10));
+	assert(add_region(200, 1000));
+	assert(!add_region(50, 50));
+	mark_range_as_free(2 * PAGE_SIZE, 9 * PAGE_SIZE);
+	mark_range_as_free(16 * PAGE_SIZE, 99 * PAGE_SIZE);
+	mark_range_as_free(200 * PAGE_SIZE, 999 * PAGE_SIZE);
+	zones[ZONE_NORMAL].next_frame = 0;
+
+	assert_eq(nb_free_frames(), 8 + 84 + 800);
+	assert_eq(pmm_audit(), OK);
+	pmm_get_stats(&stats);
+	assert_eq(stats.nb_free, 8 + 84 + 800);
+	assert_eq(stats.nb_used, 0);
+	assert_eq(stats.largest_free_run, 800);
+	assert_eq(stats.nb_regions, 3);
+	assert_eq(stats.regions[0].start, 2);
+	assert_eq(stats.regions[1].start, 16);
+	assert_eq(stats.regions[2].end, 1000);
+
+	/* Counters follow allocations */
+	assert_eq(alloc_frame(), 2 * PAGE_SIZE);
+	assert_eq(alloc_frames(5), 32 * PAGE_SIZE);
+	mark_range_as_allocated(500 * PAGE_SIZE, 500 * PAGE_SIZE);
+	assert_eq(nb_free_frames(), 8 + 84 + 800 - 34);
+	assert_eq(pmm_audit(), OK);
+	pmm_get_stats(&stats);
+	assert_eq(stats.nb_used, 34);
+	assert_eq(stats.regions[0].nb_free, 7);
+	assert_eq(stats.regions[0].nb_used, 1);
+	assert_eq(stats.regions[1].nb_free, 52);
+	assert_eq(stats.regions[1].nb_used, 32);
+	assert_eq(stats.regions[2].nb_used, 1);
+	assert_eq(stats.largest_free_run, 499);
+
+	free_frame(2 * PAGE_SIZE);
+	free_frames(32 * PAGE_SIZE, 5);
+	assert_eq(nb_free_frames(), 8 + 84 + 800 - 1);
+	assert_eq(pmm_audit(), OK);
+
+	/* The audit catches counters that went out of sync with the bitmap */
+	frame_bitmap[0] ^= GET_FRAME_MASK(4 * PAGE_SIZE);
+	assert_eq(pmm_audit(), ERR_BAD_STATE);
+	frame_bitmap[0] ^= GET_FRAME_MASK(4 * PAGE_SIZE);
+	assert_eq(pmm_audit(), OK);
+}
+
+/*
+** Some unit tests for the range operations, checked against the frame-by-frame ones.
+*/
+static void
+pmm_test_ranges(void)
+{
+	size_t i;
+
+	pmm_test_reset(false);
+	assert(add_region(5, 3000));
+	assert(add_region(3100, 3200));
+
+	/* Unaligned head and tail, crossing a summary cell */
+	mark_range_as_free(37 * PAGE_SIZE, 2100 * PAGE_SIZE);
+	assert_eq(nb_free_frames(), 2100 - 37 + 1);
+	assert_eq(pmm_audit(), OK);
+	assert(is_frame_allocated(36 * PAGE_SIZE));
+	assert(!is_frame_allocated(37 * PAGE_SIZE));
+	assert(!is_frame_allocated(2100 * PAGE_SIZE));
+	assert(is_frame_allocated(2101 * PAGE_SIZE));
+
+	/* Within a single cell */
+	mark_range_as_allocated(40 * PAGE_SIZE, 45 * PAGE_SIZE);
+	assert_eq(nb_free_frames(), 2100 - 37 + 1 - 6);
+	assert_eq(pmm_audit(), OK);
+
+	/* Partly over frames already taken, and over a hole between regions */
+	mark_range_as_allocated(2000 * PAGE_SIZE, 3150 * PAGE_SIZE);
+	assert_eq(nb_free_frames(), 2000 - 37 - 6);
+	assert_eq(pmm_audit(), OK);
+	mark_range_as_free(2990 * PAGE_SIZE, 3120 * PAGE_SIZE);
+	assert_eq(nb_free_frames(), 2000 - 37 - 6 + 131);
+	assert_eq(pmm_audit(), OK);
+
+	/* Same result as freeing frame by frame */
+	i = 2990;
+	while (i <= 3120)
+	{
+		mark_frame_as_allocated(i * PAGE_SIZE);
+		++i;
+	}
+	i = 2990;
+	while (i <= 3120)
+	{
+		mark_frame_as_free(i * PAGE_SIZE);
+		++i;
+	}
+	assert_eq(nb_free_frames(), 2000 - 37 - 6 + 131);
+	assert_eq(pmm_audit(), OK);
+
+	/* Ranges going beyond the bitmap are clipped */
+	mark_range_as_free(0, (nb_frames - 1) * PAGE_SIZE);
+	assert_eq(nb_free_frames(), nb_frames);
+	assert_eq(pmm_audit(), OK);
+	mark_range_as_allocated((nb_frames - 64) * PAGE_SIZE, 0xfffff000);
+	assert_eq(nb_free_frames(), nb_frames - 64);
+	assert_eq(pmm_audit(), OK);
+}
+
+/*
+** Some unit tests for the zones.
+*/
+static void
+pmm_test_zones(void)
+{
+	struct pmm_stats stats;
+	size_t i;
+
+	pmm_test_reset(true);
+	setup_zones(2 * FRAME_SUMMARY_FRAMES);
+	assert_eq(zones[ZONE_DMA].watermark, FRAME_SUMMARY_FRAMES / 2);
+
+	/* Normal allocations stay out of the DMA zone */
+	assert_eq(alloc_frame(), 2 * FRAME_SUMMARY_FRAMES * PAGE_SIZE);
+	assert_eq(alloc_frames(3), (2 * FRAME_SUMMARY_FRAMES + 8) * PAGE_SIZE);
+	assert_eq(alloc_frames(PMM_MAX_ORDER), 3 * FRAME_SUMMARY_FRAMES * PAGE_SIZE);
+	assert_eq(alloc_frame_zone(ZONE_DMA), 0x0);
+	assert_eq(alloc_frames_zone(3, ZONE_DMA), 8 * PAGE_SIZE);
+	pmm_get_stats(&stats);
+	assert_eq(stats.zones[ZONE_DMA].nb_free, 2 * FRAME_SUMMARY_FRAMES - 9);
+	assert_eq(pmm_audit(), OK);
+
+	/* Once the normal zone is exhausted, they fall back to the DMA one, down to its watermark */
+	mark_range_as_allocated(2 * FRAME_SUMMARY_FRAMES * PAGE_SIZE, (nb_frames - 1) * PAGE_SIZE);
+	assert_eq(zones[ZONE_NORMAL].nb_free, 0);
+	i = 0;
+	while (alloc_frame() != NULL_FRAME) {
+		++i;
+	}
+	assert_eq(i, 2 * FRAME_SUMMARY_FRAMES - 9 - FRAME_SUMMARY_FRAMES / 2);
+	assert_eq(zones[ZONE_DMA].nb_free, FRAME_SUMMARY_FRAMES / 2);
+	assert_eq(alloc_frames(1), NULL_FRAME);
+
+	/* DMA allocations can still use what's left */
+	assert_neq(alloc_frames_zone(1, ZONE_DMA), NULL_FRAME);
+	while (alloc_frame_zone(ZONE_DMA) != NULL_FRAME);
+	assert_eq(zones[ZONE_DMA].nb_free, 0);
+	assert_eq(pmm_audit(), OK);
+
+	/* Freed frames are reused within their zone */
+	free_frame(2 * FRAME_SUMMARY_FRAMES * PAGE_SIZE);
+	free_frame(5 * PAGE_SIZE);
+	assert_eq(alloc_frame_zone(ZONE_DMA), 5 * PAGE_SIZE);
+	assert_eq(alloc_frame_zone(ZONE_DMA), NULL_FRAME);
+	assert_eq(alloc_frame(), 2 * FRAME_SUMMARY_FRAMES * PAGE_SIZE);
+	assert_eq(pmm_audit(), OK);
+}
+
+/*
+** Some unit tests for the frame descriptors.
+*/
+static void
+pmm_test_pages(void)
+{
+	phys_addr_t pa;
+
+	pmm_test_reset(true);
+
+	/* Allocated frames have a single reference */
+	pa = alloc_frame();
+	assert_eq(phys_to_page(pa)->refcount, 1);
+	assert_eq(phys_to_page(pa)->flags, 0);
+	assert_eq(phys_to_page(pa)->zone, ZONE_NORMAL);
+
+	/* A shared frame is freed when its last reference is dropped */
+	get_page(pa);
+	get_page(pa);
+	assert_eq(phys_to_page(pa)->refcount, 3);
+	free_frame(pa);
+	put_page(pa);
+	assert(is_frame_allocated(pa));
+	assert_eq(nb_free_frames(), nb_frames - 1);
+	put_page(pa);
+	assert(!is_frame_allocated(pa));
+	assert_eq(phys_to_page(pa)->refcount, 0);
+	assert_eq(nb_free_frames(), nb_frames);
+
+	/* Blocks give a reference on each of their frames */
+	pa = alloc_frames(2);
+	assert_eq(phys_to_page(pa)->refcount, 1);
+	assert_eq(phys_to_page(pa + 3 * PAGE_SIZE)->refcount, 1);
+	assert_eq(pmm_audit(), OK);
+	free_frames(pa, 2);
+	assert_eq(phys_to_page(pa + 3 * PAGE_SIZE)->refcount, 0);
+
+	/* Frames reserved at boot are flagged as such */
+	mark_range_as_allocated(0x10000, 0x20000);
+	assert_eq(phys_to_page(0x10000)->refcount, 1);
+	assert_eq(phys_to_page(0x20000)->flags, PAGE_RESERVED);
+	assert_eq(phys_to_page(0x21000)->refcount, 0);
+	assert_eq(pmm_audit(), OK);
+
+	/* The audit catches descriptors that went out of sync with the bitmap */
+	phys_to_page(0x21000)->refcount = 1;
+	assert_eq(pmm_audit(), ERR_BAD_STATE);
+	phys_to_page(0x21000)->refcount = 0;
+	assert_eq(pmm_audit(), OK);
+}
+
 /*
 ** Some unit tests for the frame allocator.
 */
 static void
 pmm_test(void)
 {
+	phys_addr_t last;
+
+	pmm_test_exhaust();
+	pmm_test_buddy();
+	pmm_test_stats();
+	pmm_test_ranges();
+	pmm_test_zones();
+	pmm_test_pages();
+
 	/* Mark everything as free for the unit tests (will be reversed after) */
-	memset(frame_bitmap, 0x00, sizeof(frame_bitmap));
+	pmm_test_reset(true);
+	last = (nb_frames - 1) * PAGE_SIZE;
+
+	/* Frames beyond the bitmap don't exist */
+	if (nb_frames < NB_FRAMES) {
+		assert(is_frame_allocated(nb_frames * PAGE_SIZE));
+		mark_range_as_allocated(last, 0xfffff000);
+		assert(is_frame_allocated(last));
+		free_frame(last);
+	}
 
-	assert(!is_frame_allocated(0xfffff000));
-	mark_frame_as_allocated(0xfffff000);
-	assert(is_frame_allocated(0xfffff000));
-	free_frame(0xfffff000);
-	assert(!is_frame_allocated(0xfffff000));
-	next_frame = 0;
+	assert(!is_frame_allocated(last));
+	mark_frame_as_allocated(last);
+	assert(is_frame_allocated(last));
+	free_frame(last);
+	assert(!is_frame_allocated(last));
+	zones[ZONE_NORMAL].next_frame = 0;
 
 	assert(!is_frame_allocated(0x0));
 	assert_eq(alloc_frame(), 0x0000);
 	assert_eq(alloc_frame(), 0x1000);
 	assert_eq(alloc_frame(), 0x2000);
 	assert(is_frame_allocated(0x0));
-	assert(!is_frame_allocated(0xfffff000));
+	assert(!is_frame_allocated(last));
 	free_frame(0x1000);
 	assert_eq(alloc_frame(), 0x1000);
 	free_frame(0x0000);
@@ -227,14 +1553,14 @@ pmm_test(void)
 	free_frame(1234 * 0x1000);
 	assert_eq(alloc_frame(), 1234 * 0x1000);
 	assert_eq(alloc_frame(), NULL_FRAME);
-	free_frame(0xfffff000);
-	assert_eq(alloc_frame(), 0xfffff000);
+	free_frame(last);
+	assert_eq(alloc_frame(), last);
 	assert_eq(alloc_frame(), NULL_FRAME);
 	free_frame(0x0);
 	assert_eq(alloc_frame(), 0x0);
 	assert_eq(alloc_frame(), NULL_FRAME);
 	assert(is_frame_allocated(0x0));
-	assert(is_frame_allocated(0xfffff000));
+	assert(is_frame_allocated(last));
 
 	/* Reset PMM */
 	pmm_reset();
@@ -10,46 +10,191 @@
 #include <kernel/spinlock.h>
 #include <kernel/thread.h>
 #include <kernel/interrupts.h>
+#include <kernel/unit-tests.h>
+#include <kernel/init.h>
 #include <debug.h>
+#include <string.h>
 
 extern struct thread thread_table[MAX_PID];
 extern struct thread *init_thread;
 extern struct spinlock thread_table_lock;
 
 /*
-** Looks for the next runnable thread.
+** Multi-level feedback queue.
+**
+** Each RUNNABLE thread waits in the run queue of its priority, 0 being the
+** highest, and the first thread of the highest non-empty queue runs next.
+**
+** A thread starts at the priority given by its nice value, and is demoted to
+** the next one each time it runs for a whole time slice, which gets longer as
+** the priority gets lower. Yielding doesn't give a new time slice, so a thread
+** can't keep its priority by yielding right before the end of it.
+**
+** Threads that wake up from I/O get back to their nice priority, so that
+** interactive threads answer quickly. Every SCHED_AGING_PERIOD ticks, all threads
+** get back to it too, so that CPU-bound threads aren't starved.
+**
+** A thread is in a run queue if and only if it is RUNNABLE.
+*/
+static struct list_node run_queues[SCHED_NB_PRIORITIES];
+static uint run_queues_mask;	/* Bit i is set if run_queues[i] isn't empty */
+static uint aging_ticks;	/* Ticks since the last aging */
+static size_t idle_ticks;	/* Ticks the cpu spent waiting for a thread to run */
+
+static_assert(SCHED_NB_PRIORITIES <= sizeof(uint) * 8);
+
+/*
+** Returns the length of the time slice of the given priority, in ticks.
+*/
+static inline uint
+get_quantum(uint priority)
+{
+	return (SCHED_QUANTUM << priority);
+}
+
+static void
+run_queue_add(struct thread *t)
+{
+	list_add_tail(&t->rq_node, run_queues + t->priority);
+	run_queues_mask |= 1u << t->priority;
+}
+
+static void
+run_queue_remove(struct thread *t)
+{
+	list_delete(&t->rq_node);
+	if (list_empty(run_queues + t->priority)) {
+		run_queues_mask &= ~(1u << t->priority);
+	}
+}
+
+/*
+** Marks the given thread as RUNNABLE, putting it at the end of the run queue
+** of its priority.
+*/
+void
+thread_set_runnable(struct thread *t)
+{
+	assert(holding_lock(&thread_table_lock));
+	assert_neq(t->state, RUNNABLE);
+
+	if (t->slice == 0) {
+		t->slice = get_quantum(t->priority);
+	}
+	t->state = RUNNABLE;
+	run_queue_add(t);
+}
+
+/*
+** Sets the priority of the given thread to its nice value, with a new time slice.
+*/
+static void
+reset_priority(struct thread *t)
+{
+	if (t->state == RUNNABLE) {
+		run_queue_remove(t);
+	}
+	t->priority = t->nice;
+	t->slice = get_quantum(t->priority);
+	if (t->state == RUNNABLE) {
+		run_queue_add(t);
+	}
+}
+
+/*
+** Sets the nice value of the given thread, which is the highest priority it
+** can get, and puts it at that priority.
+*/
+void
+thread_set_nice(struct thread *t, uint nice)
+{
+	LOCK_THREAD(state);
+	t->nice = MIN(nice, SCHED_NB_PRIORITIES - 1);
+	reset_priority(t);
+	RELEASE_THREAD(state);
+}
+
+/*
+** Puts all the runnable threads, and the given running one, back at their nice priority.
+*/
+static void
+age_threads(struct thread *current)
+{
+	struct list_node *node;
+	struct list_node *next;
+	struct thread *t;
+	uint priority;
+
+	priority = 1;
+	while (priority < SCHED_NB_PRIORITIES)
+	{
+		node = run_queues[priority].next;
+		while (node != run_queues + priority)
+		{
+			next = node->next;
+			t = get_content(node, struct thread, rq_node);
+			if (t->nice < priority) {
+				reset_priority(t);
+			}
+			node = next;
+		}
+		++priority;
+	}
+	if (current->state == RUNNING) {
+		reset_priority(current);
+	}
+}
+
+/*
+** Takes the next runnable thread out of the run queues.
+** Returns NULL if there is none.
 */
 static struct thread *
 find_next_thread(void)
 {
-	bool pass;
-	struct thread *limit;
 	struct thread *t;
 
-	pass = false;
-	t = get_current_thread() + 1;
-	limit = thread_table + MAX_PID;
+	if (run_queues_mask == 0) {
+		return (NULL);
+	}
+	t = get_content(run_queues[__builtin_ctz(run_queues_mask)].next, struct thread, rq_node);
+	run_queue_remove(t);
+	return (t);
+}
+
+/*
+** Charges a tick to the given thread, running on the cpu, demoting it if
+** it used its whole time slice.
+** A thread that runs without ever having been given one, like the boot
+** thread, is handled as if it had just used it.
+** Returns true if it has to give the cpu to an other thread.
+*/
+static bool
+sched_tick(struct thread *t)
+{
+	bool preempt;
 
-look_for_next:
-	while (t < limit)
+	preempt = false;
+	if (t->state == RUNNING && (t->slice == 0 || --t->slice == 0))
 	{
-		if (t->state == RUNNABLE) {
-			return (t);
-		}
-		t++;
+		t->priority = MIN(t->priority + 1, SCHED_NB_PRIORITIES - 1);
+		t->slice = get_quantum(t->priority);
+		preempt = true;
 	}
-	if (!pass)
-	{
-		t = thread_table;
-		limit = get_current_thread() + 1;
-		pass = true;
-		goto look_for_next;
+	if (++aging_ticks >= SCHED_AGING_PERIOD) {
+		aging_ticks = 0;
+		age_threads(t);
 	}
-	return (get_current_thread());
+
+	/* Threads of a higher priority waiting */
+	preempt |= ((run_queues_mask & ((1u << t->priority) - 1)) != 0);
+	return (preempt && t->state == RUNNING);
 }
 
 /*
 ** Finds and executes the next runnable thread.
+** If there is none and the current thread can't keep running, waits for
+** an interrupt to make one runnable.
 */
 void
 thread_reschedule(void)
@@ -62,6 +207,14 @@ thread_reschedule(void)
 
 	old = get_current_thread();
 	new = find_next_thread();
+	if (new == NULL && old->state == RUNNING) {
+		new = old;
+	}
+	while (new == NULL)
+	{
+		arch_wait_interrupt();
+		new = find_next_thread();
+	}
 	new->state = RUNNING;
 	if (new != old)
 	{
@@ -89,14 +242,303 @@ thread_yield(void)
 
 	assert(t->state == RUNNING);
 
-	t->state = RUNNABLE;
+	thread_set_runnable(t);
+	thread_reschedule();
+
+	RELEASE_THREAD(state);
+}
+
+/*
+** Suspends the given thread in the given wait queue.
+*/
+static void
+sched_block(struct thread *t, struct list_node *wait_queue)
+{
+	t->state = SUSPENDED;
+	list_add_tail(&t->rq_node, wait_queue);
+}
+
+/*
+** Suspends the current thread until thread_wakeup() is called on the given wait queue.
+** The thread lock must be held, so that the condition waited for can be checked
+** without missing the wake up.
+*/
+void
+thread_wait(struct list_node *wait_queue)
+{
+	assert(holding_lock(&thread_table_lock));
+	assert_eq(get_current_thread()->state, RUNNING);
+
+	sched_block(get_current_thread(), wait_queue);
 	thread_reschedule();
+}
+
+/*
+** Makes all the threads of the given wait queue runnable. As they were waiting
+** for I/O, they get back to their nice priority.
+** Returns true if the given thread, running on the cpu, has to give it to them.
+*/
+static bool
+sched_wakeup(struct list_node *wait_queue, struct thread *current)
+{
+	struct thread *t;
+	bool preempt;
+
+	preempt = false;
+	while (!list_empty(wait_queue))
+	{
+		t = get_content(wait_queue->next, struct thread, rq_node);
+		list_delete(&t->rq_node);
+		t->state = NONE;
+		t->priority = t->nice;
+		t->slice = get_quantum(t->priority);
+		thread_set_runnable(t);
+		preempt |= (t->priority < current->priority);
+	}
+	return (preempt && current->state == RUNNING);
+}
 
+/*
+** Wakes up all the threads of the given wait queue.
+** Returns true if the current thread should give them the cpu.
+*/
+bool
+thread_wakeup(struct list_node *wait_queue)
+{
+	bool preempt;
+
+	LOCK_THREAD(state);
+	preempt = sched_wakeup(wait_queue, get_current_thread());
 	RELEASE_THREAD(state);
+	return (preempt);
+}
+
+/*
+** Returns the number of ticks the cpu spent halted, waiting for a thread to run.
+*/
+size_t
+sched_get_idle_ticks(void)
+{
+	return (idle_ticks);
 }
 
 enum handler_return
 irq_timer_handler(void)
 {
-	return (IRQ_RESCHEDULE);
+	bool reschedule;
+
+	LOCK_THREAD(state);
+
+	/* The current thread only isn't RUNNING while thread_reschedule() waits for an other one */
+	if (get_current_thread()->state != RUNNING) {
+		++idle_ticks;
+	}
+	reschedule = sched_tick(get_current_thread());
+	RELEASE_THREAD(state);
+	return (reschedule ? IRQ_RESCHEDULE : IRQ_NO_RESCHEDULE);
+}
+
+static void
+scheduler_init(enum init_level il __unused)
+{
+	size_t i;
+
+	i = 0;
+	while (i < SCHED_NB_PRIORITIES)
+	{
+		LIST_INIT_HEAD(run_queues + i);
+		++i;
+	}
+}
+
+NEW_INIT_HOOK(scheduler, &scheduler_init, CHAOS_INIT_LEVEL_EARLIEST);
+
+/*
+** Unit tests function
+*/
+
+# define TEST_NB_HOGS		3u
+# define TEST_NB_TICKS		(SCHED_AGING_PERIOD * 16u)
+# define TEST_WAKEUP_PERIOD	5u
+
+/*
+** Takes the next thread out of the run queues and marks it as RUNNING.
+*/
+static struct thread *
+test_pick(void)
+{
+	struct thread *t;
+
+	t = find_next_thread();
+	assert_neq(t, NULL);
+	t->state = RUNNING;
+	return (t);
+}
+
+/*
+** Simulates TEST_NB_TICKS ticks of cpu time shared between CPU-bound threads and an
+** interactive one, which wakes up every TEST_WAKEUP_PERIOD ticks and blocks again
+** before the end of the tick.
+*/
+static void
+scheduler_fairness_test(struct thread *hogs, struct thread *interactive)
+{
+	struct list_node wait_queue;
+	struct thread *current;
+	size_t ran[TEST_NB_HOGS];
+	size_t latency;
+	size_t nb_wakeups;
+	size_t nb_runs;
+	size_t woken_at;
+	size_t tick;
+	size_t i;
+
+	LIST_INIT_HEAD(&wait_queue);
+	memset(ran, 0, sizeof(ran));
+	latency = 0;
+	nb_wakeups = 0;
+	nb_runs = 0;
+	woken_at = 0;
+	aging_ticks = 0;
+
+	i = 0;
+	while (i < TEST_NB_HOGS)
+	{
+		thread_set_runnable(hogs + i);
+		++i;
+	}
+	thread_set_runnable(interactive);
+
+	current = test_pick();
+	tick = 0;
+	while (tick < TEST_NB_TICKS)
+	{
+		if (tick % TEST_WAKEUP_PERIOD == 0 && interactive->state == SUSPENDED)
+		{
+			woken_at = tick;
+			++nb_wakeups;
+			if (sched_wakeup(&wait_queue, current)) {
+				thread_set_runnable(current);
+				current = test_pick();
+			}
+		}
+		while (current == interactive)
+		{
+			latency = MAX(latency, tick - woken_at);
+			++nb_runs;
+			sched_block(current, &wait_queue);
+			current = test_pick();
+		}
+		++ran[current - hogs];
+		if (sched_tick(current)) {
+			thread_set_runnable(current);
+			current = test_pick();
+		}
+		++tick;
+	}
+
+	/* The interactive thread ran each time it woke up, without waiting for the hogs' slices */
+	assert_eq(nb_runs, nb_wakeups + 1);
+	assert(latency <= TEST_NB_HOGS * get_quantum(0));
+
+	/* The hogs shared the rest of the cpu evenly */
+	i = 0;
+	while (i < TEST_NB_HOGS)
+	{
+		assert(ran[i] * TEST_NB_HOGS * 10 >= TEST_NB_TICKS * 9);
+		assert(ran[i] * TEST_NB_HOGS * 10 <= TEST_NB_TICKS * 11);
+		++i;
+	}
+
+	/* Take the threads out of the scheduler */
+	if (interactive->state == SUSPENDED) {
+		list_delete(&interactive->rq_node);
+	}
+	current->state = NONE;
+	while (find_next_thread() != NULL);
+}
+
+static void
+scheduler_test(void)
+{
+	static struct thread threads[TEST_NB_HOGS + 1];
+	struct list_node wait_queue;
+	struct thread *t;
+	uint old_aging_ticks;
+	size_t i;
+
+	LOCK_THREAD(state);
+	assert_eq(run_queues_mask, 0);
+	old_aging_ticks = aging_ticks;
+	aging_ticks = 0;
+	LIST_INIT_HEAD(&wait_queue);
+
+	/* Threads of the highest priority run first, in the order they became runnable */
+	thread_set_nice(threads + 0, 1);
+	thread_set_runnable(threads + 0);
+	thread_set_runnable(threads + 1);
+	thread_set_runnable(threads + 2);
+	assert_eq(test_pick(), threads + 1);
+	assert_eq(test_pick(), threads + 2);
+	assert_eq(test_pick(), threads + 0);
+	assert_eq(find_next_thread(), NULL);
+
+	/* A thread using its whole time slice is demoted, and gets a longer one */
+	t = threads + 1;
+	assert_eq(t->priority, 0);
+	assert(sched_tick(t));
+	assert_eq(t->priority, 1);
+	assert_eq(t->slice, get_quantum(1));
+	i = 1;
+	while (i < get_quantum(1))
+	{
+		assert(!sched_tick(t));
+		++i;
+	}
+	assert(sched_tick(t));
+	assert_eq(t->priority, 2);
+
+	/* A thread running without a time slice gets one instead of wrapping around */
+	t->slice = 0;
+	assert(sched_tick(t));
+	assert_eq(t->priority, 3);
+	assert_eq(t->slice, get_quantum(3));
+	t->priority = 2;
+
+	/* Even with time left, it gives the cpu to a thread of a higher priority */
+	threads[2].state = NONE;
+	thread_set_runnable(threads + 2);
+	assert(sched_tick(t));
+	assert_eq(test_pick(), threads + 2);
+
+	/* A thread waking up gets back to its nice priority, and preempts the lower ones */
+	threads[2].priority = SCHED_NB_PRIORITIES - 1;
+	sched_block(threads + 2, &wait_queue);
+	assert_eq(threads[2].state, SUSPENDED);
+	assert(sched_wakeup(&wait_queue, t));
+	assert(list_empty(&wait_queue));
+	assert_eq(threads[2].state, RUNNABLE);
+	assert_eq(threads[2].priority, 0);
+
+	/* Aging brings all threads back to their nice priority */
+	threads[0].state = NONE;
+	threads[0].priority = SCHED_NB_PRIORITIES - 1;
+	thread_set_runnable(threads + 0);
+	aging_ticks = SCHED_AGING_PERIOD - 1;
+	sched_tick(t);
+	assert_eq(aging_ticks, 0);
+	assert_eq(t->priority, 0);
+	assert_eq(threads[0].priority, 1);
+	assert_eq(test_pick(), threads + 2);
+	assert_eq(test_pick(), threads + 0);
+	assert_eq(find_next_thread(), NULL);
+
+	memset(threads, 0, sizeof(threads));
+	scheduler_fairness_test(threads, threads + TEST_NB_HOGS);
+
+	assert_eq(run_queues_mask, 0);
+	aging_ticks = old_aging_ticks;
+	RELEASE_THREAD(state);
 }
+
+NEW_UNIT_TEST(scheduler, &scheduler_test, UNIT_TEST_LEVEL_NORMAL);
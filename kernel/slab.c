@@ -0,0 +1,455 @@
+/* ------------------------------------------------------------------------ *\
+**
+**  This file is part of the Chaos Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2017 - Benjamin Grange <benjamin.grange@epitech.eu>
+**
+\* ------------------------------------------------------------------------ */
+
+#include <kernel/slab.h>
+#include <kernel/interrupts.h>
+#include <kernel/init.h>
+#include <kernel/unit-tests.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+** Slab allocator.
+**
+** Each cache hands out objects of a single size, carved from slabs of
+** 2^order pages given by alloc_kpages(). Slabs are aligned on their size,
+** so the slab holding an object is found by rounding its address down.
+**
+** The free objects of a slab are linked together, and the slabs that aren't
+** full are linked in their cache, so both allocating and freeing an object
+** are O(1).
+**
+** Caches with a constructor hand out objects already initialized: it is called
+** once on each object when its slab is created, and the objects must be given
+** back in that state. Their free list link is therefore stored after them, and
+** not in their first word.
+*/
+
+static struct kmem_cache	cache_cache;	/* The cache of the caches */
+static struct list_node		caches = LIST_INIT_VALUE(caches);
+static struct spinlock		caches_lock;
+
+# define LOCK_CACHE(cache, state)	LOCK(&(cache)->lock, state)
+# define RELEASE_CACHE(cache, state)	RELEASE(&(cache)->lock, state)
+
+static_assert(SLAB_SIZE >= 2 * sizeof(struct slab));
+
+/*
+** Sets up an empty cache of objects of the given size, aligned on 'align' bytes,
+** which must be a power of two not greater than a page.
+**
+** The slabs are the smallest ones, from SLAB_ORDER up, that waste less than an
+** eighth of their size.
+*/
+void
+kmem_cache_init(struct kmem_cache *cache, char const *name, size_t size, size_t align, kmem_ctor_t ctor)
+{
+	size_t slab_size;
+
+	align = MAX(align, sizeof(void *));
+	assert(!(align & (align - 1)) && align <= PAGE_SIZE);
+
+	cache->name = name;
+	cache->size = size;
+	cache->ctor = ctor;
+	cache->link = ctor ? ALIGN(size, sizeof(void *)) : 0;
+	cache->stride = ALIGN(MAX(size, cache->link + sizeof(void *)), align);
+	cache->order = SLAB_ORDER;
+	while (42)
+	{
+		slab_size = PAGE_SIZE << cache->order;
+		cache->nb_per_slab = (slab_size - sizeof(struct slab)) / cache->stride;
+		if ((cache->nb_per_slab && slab_size - cache->nb_per_slab * cache->stride <= slab_size / 8)
+			|| cache->order == PMM_MAX_ORDER) {
+			break;
+		}
+		++cache->order;
+	}
+	assert(cache->nb_per_slab);
+	cache->offset = slab_size - cache->nb_per_slab * cache->stride;
+	cache->nb_slabs = 0;
+	cache->nb_active = 0;
+	cache->nb_allocs = 0;
+	LIST_INIT_HEAD(&cache->partial);
+	init_lock(&cache->lock);
+
+	LOCK(&caches_lock, state);
+	list_add_tail(&cache->node, &caches);
+	RELEASE(&caches_lock, state);
+}
+
+/*
+** Creates a new cache. See kmem_cache_init().
+** Returns NULL if there is no memory left.
+*/
+struct kmem_cache *
+kmem_cache_create(char const *name, size_t size, size_t align, kmem_ctor_t ctor)
+{
+	struct kmem_cache *cache;
+
+	cache = kmem_cache_alloc(&cache_cache);
+	if (cache != NULL) {
+		kmem_cache_init(cache, name, size, align, ctor);
+	}
+	return (cache);
+}
+
+/*
+** Tears down a cache set up by kmem_cache_init(), giving its slabs back to the
+** page allocator. All its objects must have been freed.
+*/
+void
+kmem_cache_fini(struct kmem_cache *cache)
+{
+	struct slab *slab;
+
+	LOCK(&caches_lock, state);
+	list_delete(&cache->node);
+	RELEASE(&caches_lock, state);
+
+	/* Without objects in use, all the slabs are in the partial list */
+	LOCK_CACHE(cache, state2);
+	assert_eq(cache->nb_active, 0);
+	while (!list_empty(&cache->partial))
+	{
+		slab = get_content(cache->partial.next, struct slab, node);
+		list_delete(&slab->node);
+		free_kpages(slab, cache->order);
+		--cache->nb_slabs;
+	}
+	assert_eq(cache->nb_slabs, 0);
+	RELEASE_CACHE(cache, state2);
+}
+
+/*
+** Destroys a cache given by kmem_cache_create(). See kmem_cache_fini().
+*/
+void
+kmem_cache_destroy(struct kmem_cache *cache)
+{
+	kmem_cache_fini(cache);
+	kmem_cache_free(&cache_cache, cache);
+}
+
+/*
+** Allocates a new slab for the given cache, and links all its objects together.
+*/
+static struct slab *
+new_slab(struct kmem_cache *cache)
+{
+	struct slab *slab;
+	uchar *obj;
+	size_t i;
+
+	slab = alloc_kpages(cache->order);
+	if (slab == NULL) {
+		return (NULL);
+	}
+	slab->cache = cache;
+	slab->magic = SLAB_MAGIC;
+	slab->nb_free = cache->nb_per_slab;
+	slab->free = (uchar *)slab + cache->offset;
+
+	obj = slab->free;
+	i = 0;
+	while (i < cache->nb_per_slab)
+	{
+		if (cache->ctor) {
+			cache->ctor(obj);
+		}
+		*(void **)(obj + cache->link) = (i + 1 < cache->nb_per_slab) ? obj + cache->stride : NULL;
+		obj += cache->stride;
+		++i;
+	}
+	++cache->nb_slabs;
+	return (slab);
+}
+
+/*
+** Allocates an object of the given cache.
+** Returns NULL if there is no memory left.
+*/
+virt_addr_t
+kmem_cache_alloc(struct kmem_cache *cache)
+{
+	struct slab *slab;
+	uchar *obj;
+
+	assert(cache->stride);
+	LOCK_CACHE(cache, state);
+	if (list_empty(&cache->partial))
+	{
+		slab = new_slab(cache);
+		if (slab == NULL) {
+			RELEASE_CACHE(cache, state);
+			return (NULL);
+		}
+		list_add(&slab->node, &cache->partial);
+	}
+	else {
+		slab = get_content(cache->partial.next, struct slab, node);
+	}
+
+	obj = slab->free;
+	slab->free = *(void **)(obj + cache->link);
+	--slab->nb_free;
+	if (slab->nb_free == 0) {
+		list_delete(&slab->node);
+	}
+	++cache->nb_active;
+	++cache->nb_allocs;
+	RELEASE_CACHE(cache, state);
+	return (obj);
+}
+
+/*
+** Gives an object back to the given cache.
+** An empty slab is given back to the page allocator, unless it is the only
+** one with free objects left, to avoid allocating it again right away.
+*/
+void
+kmem_cache_free(struct kmem_cache *cache, virt_addr_t obj)
+{
+	struct slab *slab;
+
+	slab = (struct slab *)ROUND_DOWN((uintptr)obj, PAGE_SIZE << cache->order);
+	assert(slab->cache == cache);
+	assert((size_t)((uchar *)obj - (uchar *)slab - cache->offset) % cache->stride == 0);
+
+	LOCK_CACHE(cache, state);
+	*(void **)((uchar *)obj + cache->link) = slab->free;
+	slab->free = obj;
+	++slab->nb_free;
+	--cache->nb_active;
+	if (slab->nb_free == 1) {
+		list_add(&slab->node, &cache->partial);
+	}
+	if (slab->nb_free == cache->nb_per_slab
+		&& (cache->partial.next != &slab->node || cache->partial.prev != &slab->node))
+	{
+		list_delete(&slab->node);
+		free_kpages(slab, cache->order);
+		--cache->nb_slabs;
+	}
+	RELEASE_CACHE(cache, state);
+}
+
+/*
+** Fills the given structure with the statistics of the given cache.
+*/
+void
+kmem_cache_get_stats(struct kmem_cache *cache, struct kmem_cache_stats *stats)
+{
+	LOCK_CACHE(cache, state);
+	stats->name = cache->name;
+	stats->size = cache->size;
+	stats->nb_slabs = cache->nb_slabs;
+	stats->nb_active = cache->nb_active;
+	stats->nb_free = cache->nb_slabs * cache->nb_per_slab - cache->nb_active;
+	stats->nb_allocs = cache->nb_allocs;
+	RELEASE_CACHE(cache, state);
+}
+
+/*
+** Prints the statistics of all caches.
+** Only used for debugging.
+*/
+void
+kmem_cache_dump(void)
+{
+	struct kmem_cache *cache;
+	struct kmem_cache_stats stats;
+
+	LOCK(&caches_lock, state);
+	printf("%-16s %6s %6s %8s %8s %10s\n", "cache", "size", "slabs", "active", "free", "allocs");
+	list_foreach_content(cache, &caches, node)
+	{
+		kmem_cache_get_stats(cache, &stats);
+		printf("%-16s %6u %6u %8u %8u %10u\n",
+			stats.name,
+			stats.size,
+			stats.nb_slabs,
+			stats.nb_active,
+			stats.nb_free,
+			stats.nb_allocs
+		);
+	}
+	RELEASE(&caches_lock, state);
+}
+
+/*
+** Tells if the given address is an object given by a size class of kalloc(),
+** that is an object of a slab of order SLAB_ORDER.
+** The page allocator also holds the slabs of other orders and the mappings of
+** map_kpages(), so the header the address would belong to must be checked.
+*/
+bool
+is_slab_object(virt_addr_t va)
+{
+	struct slab *slab;
+
+	if (va < ARCH_KPAGES_START || va >= ARCH_KPAGES_END) {
+		return (false);
+	}
+	slab = (struct slab *)ROUND_DOWN((uintptr)va, SLAB_SIZE);
+	if (!arch_is_allocated(slab) || slab->magic != SLAB_MAGIC) {
+		return (false);
+	}
+	return (slab->cache->order == SLAB_ORDER);
+}
+
+/*
+** Returns the cache the given object belongs to.
+** Only works for caches whose slabs are of order SLAB_ORDER, like the size classes.
+*/
+struct kmem_cache *
+get_slab_cache(virt_addr_t obj)
+{
+	struct kmem_cache *cache;
+
+	assert(is_slab_object(obj));
+	cache = ((struct slab *)ROUND_DOWN((uintptr)obj, SLAB_SIZE))->cache;
+	assert_eq(cache->order, SLAB_ORDER);
+	return (cache);
+}
+
+static void
+slab_init(enum init_level il __unused)
+{
+	init_lock(&caches_lock);
+	kmem_cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL);
+}
+
+NEW_INIT_HOOK(slab, &slab_init, CHAOS_INIT_LEVEL_VMM + 1);
+
+/*
+** Unit tests function
+*/
+
+static void
+slab_test_ctor(virt_addr_t obj)
+{
+	memset(obj, 0x2A, 100);
+}
+
+static void
+slab_test(void)
+{
+	static struct kmem_cache cache;
+	static void *objs[512];
+	struct kmem_cache *typed;
+	struct kmem_cache *big;
+	struct kmem_cache *other;
+	struct kmem_cache_stats stats;
+	struct slab *slab;
+	uchar *obj;
+	size_t free;
+	size_t i;
+
+	kmem_cache_init(&cache, "test", 200, 0, NULL);
+	assert_eq(cache.stride, 200);
+	assert_eq(cache.order, SLAB_ORDER);
+	assert_eq(cache.offset + cache.nb_per_slab * cache.stride, SLAB_SIZE);
+	assert(cache.offset >= sizeof(struct slab));
+
+	/* Objects fill a slab before an other one is taken */
+	i = 0;
+	while (i < 512)
+	{
+		objs[i] = kmem_cache_alloc(&cache);
+		assert_neq(objs[i], NULL);
+		assert_eq(get_slab_cache(objs[i]), &cache);
+		*(size_t *)objs[i] = i;
+		++i;
+	}
+	slab = (struct slab *)ROUND_DOWN((uintptr)objs[0], SLAB_SIZE);
+	assert_eq(ROUND_DOWN((uintptr)objs[cache.nb_per_slab - 1], SLAB_SIZE), (uintptr)slab);
+	assert_neq(ROUND_DOWN((uintptr)objs[cache.nb_per_slab], SLAB_SIZE), (uintptr)slab);
+
+	/* A freed object is the next one given */
+	kmem_cache_free(&cache, objs[42]);
+	assert_eq(slab->nb_free, 1);
+	assert_eq(kmem_cache_alloc(&cache), objs[42]);
+	assert_eq(slab->nb_free, 0);
+
+	/* Objects don't overlap */
+	*(size_t *)objs[42] = 42;
+	i = 0;
+	while (i < 512)
+	{
+		assert_eq(*(size_t *)objs[i], i);
+		kmem_cache_free(&cache, objs[i]);
+		++i;
+	}
+
+	/* Only one empty slab is kept */
+	assert_eq(cache.partial.next, cache.partial.prev);
+	slab = get_content(cache.partial.next, struct slab, node);
+	assert_eq(slab->nb_free, cache.nb_per_slab);
+
+	kmem_cache_get_stats(&cache, &stats);
+	assert_eq(stats.nb_slabs, 1);
+	assert_eq(stats.nb_active, 0);
+	assert_eq(stats.nb_free, cache.nb_per_slab);
+	assert_eq(stats.nb_allocs, 513);
+
+	/* Aligned objects, given back constructed */
+	typed = kmem_cache_create("test-typed", 100, 64, &slab_test_ctor);
+	assert_neq(typed, NULL);
+	assert_eq(typed->stride, 128);
+	i = 0;
+	while (i < 64)
+	{
+		objs[i] = kmem_cache_alloc(typed);
+		assert_neq(objs[i], NULL);
+		assert(!((uintptr)objs[i] & 63));
+		obj = objs[i];
+		assert_eq(obj[0], 0x2A);
+		assert_eq(obj[99], 0x2A);
+		++i;
+	}
+	i = 0;
+	while (i < 64)
+	{
+		kmem_cache_free(typed, objs[i]);
+		++i;
+	}
+	obj = kmem_cache_alloc(typed);
+	assert_eq(obj[0], 0x2A);
+	assert_eq(obj[99], 0x2A);
+	kmem_cache_free(typed, obj);
+
+	/* Objects too big for the default slabs get bigger ones */
+	big = kmem_cache_create("test-big", SLAB_SIZE, PAGE_SIZE, NULL);
+	assert_neq(big, NULL);
+	assert(big->order > SLAB_ORDER);
+	obj = kmem_cache_alloc(big);
+	assert_neq(obj, NULL);
+	assert(IS_PAGE_ALIGNED(obj));
+	assert(!is_slab_object(obj));
+	assert(!is_slab_object((virt_addr_t)ROUND_DOWN((uintptr)obj, PAGE_SIZE << big->order)));
+	kmem_cache_get_stats(big, &stats);
+	assert_eq(stats.nb_slabs, 1);
+	assert_eq(stats.nb_active, 1);
+	kmem_cache_free(big, obj);
+
+	/* Destroyed caches give their slabs back, and are forgotten */
+	free = nb_free_frames() + (1u << big->order);
+	kmem_cache_destroy(big);
+	assert_eq(nb_free_frames(), free);
+	kmem_cache_destroy(typed);
+	kmem_cache_fini(&cache);
+	list_foreach_content(other, &caches, node) {
+		assert_neq(other, typed);
+		assert_neq(other, big);
+		assert_neq(other, &cache);
+	}
+}
+
+NEW_UNIT_TEST(slab, &slab_test, UNIT_TEST_LEVEL_VMM);
@@ -8,6 +8,8 @@
 \* ------------------------------------------------------------------------ */
 
 #include <kernel/thread.h>
+#include <kernel/kalloc.h>
+#include <kernel/slab.h>
 #include <stdio.h>
 
 /*
@@ -56,3 +58,39 @@ sys_fork(void)
 	}
 	return (-1);
 }
+
+/*
+** Does the kmemstat system call.
+** Prints the state of the kernel memory allocators.
+*/
+void
+sys_kmemstat(void)
+{
+	struct kheap_stats stats;
+
+	kmem_cache_dump();
+	kheap_get_stats(&stats);
+	printf("Kernel heap: %u trims, %u pages returned\n", stats.nb_trims, stats.pages_returned);
+#ifdef ENABLE_KALLOC_PROFILER
+	kalloc_profiler_dump();
+#endif /* ENABLE_KALLOC_PROFILER */
+}
+
+/*
+** Does the nice system call.
+** Adds 'inc' to the nice value of the current process, bounded to the available
+** priorities, and returns the new one. A higher nice value means a lower priority.
+*/
+int
+sys_nice(int inc)
+{
+	struct thread *t;
+	int nice;
+
+	t = get_current_thread();
+	nice = (int)t->nice + inc;
+	nice = MAX(nice, 0);
+	nice = MIN(nice, (int)SCHED_NB_PRIORITIES - 1);
+	thread_set_nice(t, (uint)nice);
+	return (nice);
+}
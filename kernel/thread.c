@@ -9,6 +9,7 @@
 
 #include <kernel/thread.h>
 #include <kernel/kalloc.h>
+#include <kernel/zero_pool.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -88,19 +89,19 @@ thread_create(char const *name, thread_entry_cb entry, size_t stack_size)
 	thread_set_name(t, name);
 	t->pid = pid;
 	t->entry = entry;
-	t->state = RUNNABLE;
 	t->parent = get_current_thread()->parent;
 	t->vaspace = get_current_thread()->vaspace;
 	t->vaspace->ref_count++;
 	t->cwd = strdup(get_current_thread()->cwd);
 
 	t->stack_size = stack_size;
-	t->stack = mmap(NULL, stack_size, MMAP_USER | MMAP_WRITE);
+	t->stack = mmap(NULL, stack_size, MMAP_USER | MMAP_WRITE | MMAP_LAZY);
 	assert_neq(t->stack, NULL);
 	t->stack += stack_size - 1;
 	t->stack = (void *)ROUND_DOWN((uintptr)t->stack, sizeof(void *));
 
 	arch_init_thread(t);
+	thread_set_runnable(t);
 
 	RELEASE_THREAD(state);
 	return (t);
@@ -139,12 +140,14 @@ thread_fork(void)
 	new = thread_table + pid;
 	memcpy(new, old, sizeof(*new));
 	new->pid = pid;
-	new->state = RUNNABLE;
+	new->state = NONE;
+	new->slice = 0;
 	new->parent = old;
 	new->vaspace = vaspace;
 	new->cwd = strdup(old->cwd);
 
 	arch_init_fork_thread(new);
+	thread_set_runnable(new);
 
 	RELEASE_THREAD(state);
 	return (new);
@@ -172,10 +175,15 @@ thread_exit(int status)
 		panic("%s finished (exit status: %u)", t->name, status);
 	}
 
-	/* free the virtual address space if we are the last thread using it */
+	/*
+	** Free the virtual address space if we are the last thread using it,
+	** otherwise only our stack, so that its addresses can be reused.
+	*/
 	t->vaspace->ref_count--;
 	if (t->vaspace->ref_count == 0) {
 		free_vaspace();
+	} else {
+		munmap((uchar *)ROUND_DOWN((uintptr)t->stack, PAGE_SIZE) + PAGE_SIZE - t->stack_size, t->stack_size);
 	}
 
 	t->exit_status = status & 0xFFu;
@@ -223,7 +231,7 @@ thread_execve(char const *name, int (*main)(void))
 	init_vaspace();
 
 	/* Allocate main-thread's stack */
-	t->stack = mmap(NULL, t->stack_size, MMAP_USER | MMAP_WRITE);
+	t->stack = mmap(NULL, t->stack_size, MMAP_USER | MMAP_WRITE | MMAP_LAZY);
 	assert_neq(t->stack, NULL);
 	t->stack += t->stack_size - 1;
 	t->stack = (void *)ROUND_DOWN((uintptr)t->stack, sizeof(void *));
@@ -245,7 +253,10 @@ thread_resume(struct thread *t)
 	LOCK_THREAD(state);
 	assert_neq(t->state, ZOMBIE);
 	if (t->state == SUSPENDED) {
-		t->state = RUNNABLE;
+		if (t->rq_node.next != NULL) { /* Waiting in a wait queue */
+			list_delete(&t->rq_node);
+		}
+		thread_set_runnable(t);
 		RELEASE_THREAD(state);
 		thread_yield();
 	}
@@ -276,6 +287,7 @@ thread_waitpid(pid_t pid)
 			return (val);
 		}
 		RELEASE_THREAD(state);
+		thread_yield();
 	}
 }
 
@@ -301,6 +313,9 @@ thread_init(void)
 	assert_eq(t, init_thread);
 	assert_eq(t->pid, 1);
 
+	/* Start clearing frames in the background */
+	zero_pool_start();
+
 	printf("[OK]\tMulti-threading\n");
 
 	/* Print HelloWorld message */
@@ -314,8 +329,8 @@ thread_init(void)
 	/* Remove the boot thread from the active threads */
 	get_current_thread()->state = NONE;
 
-	/* Set the init thread as runnable */
-	t->state = RUNNABLE;
+	/* The init thread is runnable since its creation */
+	assert_eq(t->state, RUNNABLE);
 
 	/* Free the pwd */
 	kfree(t->cwd);
@@ -364,4 +379,5 @@ thread_dump(void)
 		}
 		++t;
 	}
+	printf("Idle: %u ticks\n", sched_get_idle_ticks());
 }
@@ -10,9 +10,12 @@
 #include <kernel/vaspace.h>
 #include <kernel/thread.h>
 #include <kernel/kalloc.h>
+#include <kernel/slab.h>
+#include <kernel/init.h>
 #include <string.h>
 
 struct vaspace boot_vaspace; /* virtual address space of boot and init. */
+struct kmem_cache *vaspace_cache;
 
 /*
 ** Set up a new virtual address space
@@ -30,13 +33,13 @@ init_vaspace(void)
 	arch_init_vaspace();
 
 	vaspace->mmapping_start = KERNEL_VIRTUAL_BASE - PAGE_SIZE;
-	vaspace->mmapping_size = 0;
+	vaspace->nb_vmas = 0;
 
 	vaspace->heap_start = (void *)ALIGN(vaspace->binary_limit + PAGE_SIZE, PAGE_SIZE);
 	vaspace->heap_size = 0;
 
 	/* Allocate the first heap page or the ubrk algorithm will not work. */
-	assert_neq(mmap(vaspace->heap_start, PAGE_SIZE, MMAP_USER | MMAP_WRITE), NULL);
+	assert_neq(mmap(vaspace->heap_start, PAGE_SIZE, MMAP_USER | MMAP_WRITE | MMAP_LAZY), NULL);
 }
 
 /*
@@ -62,8 +65,9 @@ free_vaspace(void)
 
 	/* Clean up memory space */
 	munmap(NULL, vaspace->binary_limit);
-	munmap(vaspace->mmapping_start - vaspace->mmapping_size + PAGE_SIZE, vaspace->mmapping_size);
-	munmap(vaspace->heap_start, ALIGN(vaspace->heap_size, PAGE_SIZE) + PAGE_SIZE);
+	while (vaspace->nb_vmas) {
+		munmap((virt_addr_t)vaspace->vmas[0].start, vaspace->vmas[0].end - vaspace->vmas[0].start);
+	}
 
 	arch_free_vaspace();
 }
@@ -78,7 +82,7 @@ free_zombie_thread(struct thread *t)
 	arch_free_zombie_thread(t);
 
 	if (t->vaspace->ref_count == 0) {
-		kfree(t->vaspace);
+		kmem_cache_free(vaspace_cache, t->vaspace);
 	}
 	kfree(t->cwd);
 }
@@ -97,3 +101,12 @@ setup_boot_vaspace(void)
 
 	return (&boot_vaspace);
 }
+
+static void
+init_vaspace_cache(enum init_level il __unused)
+{
+	vaspace_cache = kmem_cache_create("vaspace", sizeof(struct vaspace), 0, NULL);
+	assert_neq(vaspace_cache, NULL);
+}
+
+NEW_INIT_HOOK(vaspace_cache, &init_vaspace_cache, CHAOS_INIT_LEVEL_VMM + 2);
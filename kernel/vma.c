@@ -0,0 +1,269 @@
+/* ------------------------------------------------------------------------ *\
+**
+**  This file is part of the Chaos Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2017 - Benjamin Grange <benjamin.grange@epitech.eu>
+**
+\* ------------------------------------------------------------------------ */
+
+#include <kernel/vma.h>
+#include <kernel/vaspace.h>
+#include <kernel/unit-tests.h>
+#include <string.h>
+
+/*
+** The regions of the user space of a virtual address space are kept in a sorted
+** array, so that the one holding a given address is found with a binary search.
+** Adjacent regions with the same protection are merged, which keeps the array
+** small: usually the heap and a few stacks.
+**
+** All these functions must be called with the virtual address space locked.
+*/
+
+/* The flags a region is made of, the other ones only matter when mapping it */
+# define VMA_FLAGS_MASK		(MMAP_USER | MMAP_WRITE)
+
+/*
+** Returns the index of the first region ending after the given address,
+** or the number of regions if there is none.
+*/
+static size_t
+vma_lookup(struct vaspace *vaspace, uintptr addr)
+{
+	size_t lo;
+	size_t hi;
+	size_t mid;
+
+	lo = 0;
+	hi = vaspace->nb_vmas;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (vaspace->vmas[mid].end <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo);
+}
+
+static void
+vma_delete(struct vaspace *vaspace, size_t i)
+{
+	memmove(vaspace->vmas + i, vaspace->vmas + i + 1, (vaspace->nb_vmas - i - 1) * sizeof(struct vma));
+	--vaspace->nb_vmas;
+}
+
+static status_t
+vma_add(struct vaspace *vaspace, size_t i, uintptr start, uintptr end, mmap_flags_t flags)
+{
+	if (vaspace->nb_vmas == MAX_VMAS) {
+		return (ERR_NO_MEMORY);
+	}
+	memmove(vaspace->vmas + i + 1, vaspace->vmas + i, (vaspace->nb_vmas - i) * sizeof(struct vma));
+	vaspace->vmas[i].start = start;
+	vaspace->vmas[i].end = end;
+	vaspace->vmas[i].flags = flags;
+	++vaspace->nb_vmas;
+	return (OK);
+}
+
+/*
+** Returns the region holding the given address, or NULL if it isn't mapped.
+*/
+struct vma *
+vma_find(struct vaspace *vaspace, virt_addr_t va)
+{
+	size_t i;
+
+	i = vma_lookup(vaspace, (uintptr)va);
+	if (i < vaspace->nb_vmas && vaspace->vmas[i].start <= (uintptr)va) {
+		return (vaspace->vmas + i);
+	}
+	return (NULL);
+}
+
+/*
+** Records a new region, merging it with its neighbours if they have the same flags.
+** Fails if it overlaps an other region, or if there are too many of them.
+*/
+status_t
+vma_insert(struct vaspace *vaspace, virt_addr_t va, size_t size, mmap_flags_t flags)
+{
+	struct vma *vmas;
+	uintptr start;
+	uintptr end;
+	bool merge_prev;
+	bool merge_next;
+	size_t i;
+
+	assert(IS_PAGE_ALIGNED(va));
+	assert(IS_PAGE_ALIGNED(size));
+	vmas = vaspace->vmas;
+	start = (uintptr)va;
+	end = start + size;
+	flags &= VMA_FLAGS_MASK;
+
+	i = vma_lookup(vaspace, start);
+	if (i < vaspace->nb_vmas && vmas[i].start < end) {
+		return (ERR_ALREADY_MAPPED);
+	}
+
+	merge_prev = (i > 0 && vmas[i - 1].end == start && vmas[i - 1].flags == flags);
+	merge_next = (i < vaspace->nb_vmas && vmas[i].start == end && vmas[i].flags == flags);
+	if (merge_prev && merge_next) {
+		vmas[i - 1].end = vmas[i].end;
+		vma_delete(vaspace, i);
+	} else if (merge_prev) {
+		vmas[i - 1].end = end;
+	} else if (merge_next) {
+		vmas[i].start = start;
+	} else {
+		return (vma_add(vaspace, i, start, end, flags));
+	}
+	return (OK);
+}
+
+/*
+** Forgets the given range, that may span several regions or only a part of one.
+** Fails if a region has to be split in two but there are too many of them.
+*/
+status_t
+vma_remove(struct vaspace *vaspace, virt_addr_t va, size_t size)
+{
+	struct vma *vmas;
+	uintptr start;
+	uintptr end;
+	size_t i;
+
+	assert(IS_PAGE_ALIGNED(va));
+	assert(IS_PAGE_ALIGNED(size));
+	vmas = vaspace->vmas;
+	start = (uintptr)va;
+	end = start + size;
+
+	i = vma_lookup(vaspace, start);
+
+	/* A hole in the middle of a region */
+	if (i < vaspace->nb_vmas && vmas[i].start < start && vmas[i].end > end)
+	{
+		if (vma_add(vaspace, i + 1, end, vmas[i].end, vmas[i].flags) != OK) {
+			return (ERR_NO_MEMORY);
+		}
+		vmas[i].end = start;
+		return (OK);
+	}
+
+	while (i < vaspace->nb_vmas && vmas[i].start < end)
+	{
+		if (vmas[i].start < start) {
+			vmas[i].end = start;
+			++i;
+		} else if (vmas[i].end > end) {
+			vmas[i].start = end;
+			break;
+		} else {
+			vma_delete(vaspace, i);
+		}
+	}
+	return (OK);
+}
+
+/*
+** Looks for 'size' bytes of unmapped addresses between 'low' and 'high',
+** as close as possible to 'high'.
+** Returns the start of the gap, or NULL if there is none big enough.
+*/
+virt_addr_t
+vma_find_gap(struct vaspace *vaspace, virt_addr_t low, virt_addr_t high, size_t size)
+{
+	struct vma *vmas;
+	uintptr top;
+	uintptr bottom;
+	size_t i;
+
+	vmas = vaspace->vmas;
+	top = (uintptr)high;
+	i = vma_lookup(vaspace, top);
+	if (i < vaspace->nb_vmas && vmas[i].start < top) {
+		top = vmas[i].start;
+	}
+
+	while (top > (uintptr)low)
+	{
+		bottom = (i > 0) ? MAX(vmas[i - 1].end, (uintptr)low) : (uintptr)low;
+		if (top - bottom >= size) {
+			return ((virt_addr_t)(top - size));
+		}
+		if (i == 0) {
+			break;
+		}
+		--i;
+		top = vmas[i].start;
+	}
+	return (NULL);
+}
+
+/*
+** Unit tests function
+*/
+
+static void
+vma_test(void)
+{
+	static struct vaspace vaspace;
+
+	memset(&vaspace, 0, sizeof(vaspace));
+
+	/* Insertion & merging */
+	assert_eq(vma_insert(&vaspace, (virt_addr_t)0x10000, 0x2000, MMAP_USER | MMAP_WRITE), OK);
+	assert_eq(vma_insert(&vaspace, (virt_addr_t)0x20000, 0x1000, MMAP_USER | MMAP_WRITE | MMAP_LAZY), OK);
+	assert_eq(vaspace.nb_vmas, 2);
+	assert_eq(vma_insert(&vaspace, (virt_addr_t)0x11000, 0x1000, MMAP_USER), ERR_ALREADY_MAPPED);
+	assert_eq(vma_insert(&vaspace, (virt_addr_t)0xF000, 0x2000, MMAP_USER), ERR_ALREADY_MAPPED);
+	assert_eq(vma_insert(&vaspace, (virt_addr_t)0x12000, 0xE000, MMAP_USER | MMAP_WRITE), OK);
+	assert_eq(vaspace.nb_vmas, 1);
+	assert_eq(vaspace.vmas[0].start, 0x10000);
+	assert_eq(vaspace.vmas[0].end, 0x21000);
+	assert_eq(vma_insert(&vaspace, (virt_addr_t)0x21000, 0x1000, MMAP_USER), OK);
+	assert_eq(vaspace.nb_vmas, 2);
+
+	/* Lookup */
+	assert_eq(vma_find(&vaspace, (virt_addr_t)0xFFFF), NULL);
+	assert_eq(vma_find(&vaspace, (virt_addr_t)0x10000), vaspace.vmas);
+	assert_eq(vma_find(&vaspace, (virt_addr_t)0x20FFF), vaspace.vmas);
+	assert_eq(vma_find(&vaspace, (virt_addr_t)0x21000), vaspace.vmas + 1);
+	assert_eq(vma_find(&vaspace, (virt_addr_t)0x22000), NULL);
+
+	/* Removal, in the middle, at the edges and across regions */
+	assert_eq(vma_remove(&vaspace, (virt_addr_t)0x14000, 0x2000), OK);
+	assert_eq(vaspace.nb_vmas, 3);
+	assert_eq(vma_find(&vaspace, (virt_addr_t)0x15000), NULL);
+	assert_eq(vma_find(&vaspace, (virt_addr_t)0x16000)->start, 0x16000);
+	assert_eq(vma_remove(&vaspace, (virt_addr_t)0x10000, 0x1000), OK);
+	assert_eq(vaspace.vmas[0].start, 0x11000);
+	assert_eq(vma_remove(&vaspace, (virt_addr_t)0x20000, 0x10000), OK);
+	assert_eq(vaspace.nb_vmas, 2);
+	assert_eq(vaspace.vmas[1].end, 0x20000);
+
+	/* Gaps, found as high as possible */
+	assert_eq(vma_find_gap(&vaspace, (virt_addr_t)0x1000, (virt_addr_t)0x30000, 0x1000), (virt_addr_t)0x2F000);
+	assert_eq(vma_find_gap(&vaspace, (virt_addr_t)0x1000, (virt_addr_t)0x1A000, 0x2000), (virt_addr_t)0x14000);
+	assert_eq(vma_find_gap(&vaspace, (virt_addr_t)0x1000, (virt_addr_t)0x1A000, 0x3000), (virt_addr_t)0xE000);
+	assert_eq(vma_find_gap(&vaspace, (virt_addr_t)0x10000, (virt_addr_t)0x1A000, 0x3000), NULL);
+	assert_eq(vma_find_gap(&vaspace, (virt_addr_t)0x16000, (virt_addr_t)0x30000, 0x10001), NULL);
+
+	/* Running out of regions */
+	while (vaspace.nb_vmas < MAX_VMAS) {
+		assert_eq(vma_insert(&vaspace, (virt_addr_t)(0x100000 + vaspace.nb_vmas * 0x2000), 0x1000, MMAP_USER), OK);
+	}
+	assert_eq(vma_insert(&vaspace, (virt_addr_t)0x1000, 0x1000, MMAP_USER), ERR_NO_MEMORY);
+	assert_eq(vma_remove(&vaspace, (virt_addr_t)0x12000, 0x1000), ERR_NO_MEMORY);
+	assert_eq(vma_remove(&vaspace, (virt_addr_t)0x11000, 0x1000), OK);
+	assert_eq(vma_remove(&vaspace, (virt_addr_t)0x0, 0x200000), OK);
+	assert_eq(vaspace.nb_vmas, 0);
+}
+
+NEW_UNIT_TEST(vma, &vma_test, UNIT_TEST_LEVEL_EARLY);
@@ -16,17 +16,65 @@
 #include <kernel/thread.h>
 #include <kernel/interrupts.h>
 #include <stdio.h>
+#include <string.h>
 
 /* Heap main variables */
 virt_addr_t kernel_heap_start;
 size_t kernel_heap_size;
 
+/*
+** Page allocator variables.
+**
+** The addresses handed out by alloc_kpages() are managed by a buddy allocator,
+** growing from the bottom of the area by blocks of the highest order. The free
+** blocks of each order are recorded in a bitmap, as they aren't mapped and
+** can't hold a free list. The addresses used by map_kpages() are taken from the
+** top of the area, and never given back.
+*/
+# define KPAGES_NB_PAGES	(ARCH_KPAGES_SIZE / PAGE_SIZE)
+# define KPAGES_BITMAP_SIZE	(KPAGES_NB_PAGES / 16u + PMM_MAX_ORDER + 1u)
+
+static struct spinlock kpages_lock;
+static virt_addr_t kpages_brk;			/* End of the blocks of the buddy allocator */
+static virt_addr_t kpages_top;			/* Start of the addresses used by map_kpages() */
+static uint32 kpages_bitmap[KPAGES_BITMAP_SIZE];
+static uint32 *kpages_free[PMM_MAX_ORDER + 1];	/* One bit per block of each order, set if it is free */
+static size_t kpages_nb_free[PMM_MAX_ORDER + 1];
+static size_t kpages_hint[PMM_MAX_ORDER + 1];	/* Lowest word of each bitmap that may not be empty */
+
+static_assert(!(ARCH_KPAGES_SIZE % (PAGE_SIZE << PMM_MAX_ORDER)));
+
+# define LOCK_KPAGES(state)	LOCK(&kpages_lock, state)
+# define RELEASE_KPAGES(state)	RELEASE(&kpages_lock, state)
+
+/*
+** vmalloc() variables.
+** The areas it handed out are kept sorted by address, each one followed by an
+** unmapped guard page.
+*/
+struct vmalloc_area
+{
+	virt_addr_t start;
+	size_t size;
+};
+
+static struct spinlock vmalloc_lock;
+static struct vmalloc_area vmalloc_areas[MAX_VMALLOC_AREAS];
+static size_t nb_vmalloc_areas;
+
+# define LOCK_VMALLOC(state)	LOCK(&vmalloc_lock, state)
+# define RELEASE_VMALLOC(state)	RELEASE(&vmalloc_lock, state)
+
 /*
 ** Map contiguous virtual addresses to a random physical addresses.
 ** In case of error, the state mush be as it was before the call.
 ** If the given virtual address is NULL, then the kernel chooses
-** the destination address.
+** the destination address, reusing the holes left in the memory mapping segment.
+** The mappings of user space are recorded as regions of the virtual address space.
 ** Size must be page aligned.
+** If MMAP_LAZY is given, the pages are only reserved, and backed by a frame when
+** they are first accessed. Otherwise, large pages are used where the alignment
+** and the size allow it and the architecture agrees.
 **
 ** Returns the virtual address holding the mapping, or NULL if
 ** it fails.
@@ -39,32 +87,33 @@ mmap(virt_addr_t va, size_t size, mmap_flags_t flags)
 {
 	virt_addr_t ori_va;
 	struct vaspace *vaspace;
+	status_t s;
 
 	assert(IS_PAGE_ALIGNED(va));
 	assert(IS_PAGE_ALIGNED(size));
 
 	LOCK_VASPACE(state);
 
+	vaspace = get_current_thread()->vaspace;
 	ori_va = va;
 	if (va == NULL) /* Allocate on the memory mapping segment */
 	{
-		/* TODO Use unmaped memory of the Memory Mapping segment */
-		vaspace = get_current_thread()->vaspace;
-		ori_va = mmap((char *)vaspace->mmapping_start - vaspace->mmapping_size - size + PAGE_SIZE, size, flags);
-		if (ori_va != NULL) {
-			vaspace->mmapping_size += size;
-		}
+		/* Reuse the highest hole big enough, between the heap and the top of the segment */
+		va = vma_find_gap(vaspace, vaspace->heap_start, (uchar *)vaspace->mmapping_start + PAGE_SIZE, size);
+		ori_va = va ? mmap(va, size, flags) : NULL;
 		goto ok_ret;
 	}
 	else
 	{
-		while (va < ori_va + size)
-		{
-			if (unlikely(arch_map_page(va, flags) != OK)) {
-				munmap(ori_va, va - ori_va);
-				goto err_ret;
+		if (va < KERNEL_VIRTUAL_BASE && vma_insert(vaspace, va, size, flags) != OK) {
+			goto err_ret;
+		}
+		s = arch_map_range(va, size, flags);
+		if (unlikely(s != OK)) {
+			if (va < KERNEL_VIRTUAL_BASE) {
+				vma_remove(vaspace, va, size);
 			}
-			va += PAGE_SIZE;
+			goto err_ret;
 		}
 		goto ok_ret;
 	}
@@ -84,16 +133,15 @@ err_ret:
 void
 munmap(virt_addr_t va, size_t size)
 {
-	virt_addr_t ori_va;
-
 	assert(IS_PAGE_ALIGNED(va));
 	assert(IS_PAGE_ALIGNED(size));
-	ori_va = va;
-	while (va < ori_va + size)
-	{
-		arch_munmap_va(va);
-		va += PAGE_SIZE;
+
+	LOCK_VASPACE(state);
+	if (va < KERNEL_VIRTUAL_BASE) {
+		vma_remove(get_current_thread()->vaspace, va, MIN(size, (size_t)(KERNEL_VIRTUAL_BASE - va)));
 	}
+	arch_munmap_range(va, size);
+	RELEASE_VASPACE(state);
 }
 
 /*
@@ -174,7 +222,7 @@ ubrk(virt_addr_t new_brk)
 		vaspace->heap_size += add;
 		if (round_add > 0)
 		{
-			if (unlikely(mmap(brk + PAGE_SIZE, round_add, MMAP_USER | MMAP_WRITE) == NULL)) {
+			if (unlikely(mmap(brk + PAGE_SIZE, round_add, MMAP_USER | MMAP_WRITE | MMAP_LAZY) == NULL)) {
 				vaspace->heap_size -= add;
 				RELEASE_VASPACE(state);
 				return (ERR_NO_MEMORY);
@@ -211,6 +259,358 @@ usbrk(intptr inc)
 	return ((virt_addr_t)-1u);
 }
 
+static inline bool
+kpages_is_free(uint order, size_t idx)
+{
+	return (kpages_free[order][idx / 32u] & (1u << (idx % 32u)));
+}
+
+static void
+kpages_set_free(uint order, size_t idx, bool free)
+{
+	if (free) {
+		kpages_free[order][idx / 32u] |= 1u << (idx % 32u);
+		kpages_hint[order] = MIN(kpages_hint[order], idx / 32u);
+		++kpages_nb_free[order];
+	} else {
+		kpages_free[order][idx / 32u] &= ~(1u << (idx % 32u));
+		--kpages_nb_free[order];
+	}
+}
+
+/*
+** Returns the index of the first free block of the given order.
+** There must be one.
+** The search starts at the hint of that order, as the words below it are empty,
+** and moves it to the word holding the block found.
+*/
+static size_t
+kpages_find_free(uint order)
+{
+	size_t nb_words;
+	size_t i;
+
+	assert(kpages_nb_free[order]);
+	nb_words = ((size_t)(kpages_brk - ARCH_KPAGES_START) / (PAGE_SIZE << order) + 31u) / 32u;
+	i = kpages_hint[order];
+	while (i < nb_words)
+	{
+		if (kpages_free[order][i]) {
+			kpages_hint[order] = i;
+			return (i * 32u + __builtin_ctz(kpages_free[order][i]));
+		}
+		++i;
+	}
+	panic("The free blocks of the page allocator are inconsistent");
+}
+
+/*
+** Takes a free block of 2^order pages of addresses, splitting a bigger one if
+** needed, or taking a new one from the top of the area.
+** Returns NULL if they are all taken.
+*/
+static virt_addr_t
+kpages_take(uint order)
+{
+	size_t idx;
+	uint o;
+
+	LOCK_KPAGES(state);
+	o = order;
+	while (o <= PMM_MAX_ORDER && !kpages_nb_free[o]) {
+		++o;
+	}
+	if (o > PMM_MAX_ORDER)
+	{
+		if ((size_t)(kpages_top - kpages_brk) < (PAGE_SIZE << PMM_MAX_ORDER)) {
+			RELEASE_KPAGES(state);
+			return (NULL);
+		}
+		o = PMM_MAX_ORDER;
+		kpages_set_free(o, (size_t)(kpages_brk - ARCH_KPAGES_START) / (PAGE_SIZE << o), true);
+		kpages_brk += PAGE_SIZE << o;
+	}
+
+	/* Keep the first half of the block until it has the right order */
+	idx = kpages_find_free(o);
+	kpages_set_free(o, idx, false);
+	while (o > order)
+	{
+		--o;
+		idx *= 2;
+		kpages_set_free(o, idx + 1, true);
+	}
+	RELEASE_KPAGES(state);
+	return ((virt_addr_t)ARCH_KPAGES_START + idx * (PAGE_SIZE << order));
+}
+
+/*
+** Gives back a block of 2^order pages of addresses, merging it with its buddy
+** as long as it is free.
+*/
+static void
+kpages_give(virt_addr_t va, uint order)
+{
+	size_t idx;
+
+	LOCK_KPAGES(state);
+	idx = (size_t)(va - ARCH_KPAGES_START) / (PAGE_SIZE << order);
+	while (order < PMM_MAX_ORDER && kpages_is_free(order, idx ^ 1u))
+	{
+		kpages_set_free(order, idx ^ 1u, false);
+		idx /= 2;
+		++order;
+	}
+	kpages_set_free(order, idx, true);
+	RELEASE_KPAGES(state);
+}
+
+/*
+** Allocates 2^order contiguous and writable kernel pages, aligned on their size
+** and backed by frames that aren't necessarily contiguous.
+**
+** Returns NULL if it fails.
+*/
+virt_addr_t
+alloc_kpages(uint order)
+{
+	virt_addr_t va;
+
+	assert(order <= PMM_MAX_ORDER);
+	va = kpages_take(order);
+	if (va != NULL && mmap(va, PAGE_SIZE << order, MMAP_WRITE) == NULL) {
+		kpages_give(va, order);
+		return (NULL);
+	}
+	return (va);
+}
+
+/*
+** Frees a block given by alloc_kpages() with the same order.
+** Its frames are given back to the physical memory allocator.
+*/
+void
+free_kpages(virt_addr_t va, uint order)
+{
+	assert(order <= PMM_MAX_ORDER);
+	assert(IS_PAGE_ALIGNED(va));
+	assert(va >= ARCH_KPAGES_START && va < kpages_brk);
+	assert(!((uintptr)(va - ARCH_KPAGES_START) & ((PAGE_SIZE << order) - 1u)));
+
+	munmap(va, PAGE_SIZE << order);
+	kpages_give(va, order);
+}
+
+/*
+** Maps 'size' bytes of contiguous physical memory, starting at 'pa', on
+** addresses of the page allocator. They are never given back.
+**
+** Returns the virtual address of the mapping, or NULL if it fails.
+*/
+virt_addr_t
+map_kpages(phys_addr_t pa, size_t size)
+{
+	virt_addr_t va;
+
+	assert(IS_PAGE_ALIGNED(pa));
+	size = ALIGN(size, PAGE_SIZE);
+
+	LOCK_KPAGES(state);
+	if ((size_t)(kpages_top - kpages_brk) < size) {
+		RELEASE_KPAGES(state);
+		return (NULL);
+	}
+	kpages_top -= size;
+	va = kpages_top;
+	RELEASE_KPAGES(state);
+
+	/* Kernel page tables are all present, so this can't fail */
+	assert_eq(arch_map_phys_range(va, pa, size, MMAP_WRITE), OK);
+	return (va);
+}
+
+/*
+** Returns the index of the area of vmalloc() starting at the given address,
+** or of the first one after it if there is none.
+** vmalloc() must be locked.
+*/
+static size_t
+vmalloc_lookup(virt_addr_t va)
+{
+	size_t lo;
+	size_t hi;
+	size_t mid;
+
+	lo = 0;
+	hi = nb_vmalloc_areas;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (vmalloc_areas[mid].start < va) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo);
+}
+
+/*
+** Allocates 'size' bytes of kernel memory, rounded up to a page, on their own
+** addresses followed by an unmapped guard page. They are backed by frames that
+** aren't necessarily contiguous, and given back to the physical memory allocator
+** as soon as they are freed.
+**
+** Used for big allocations, which would otherwise punch holes in the kernel heap.
+** Returns NULL if it fails.
+*/
+virt_addr_t
+vmalloc(size_t size)
+{
+	virt_addr_t va;
+	size_t i;
+
+	size = ALIGN(size + (size == 0), PAGE_SIZE);
+
+	LOCK_VMALLOC(state);
+	if (nb_vmalloc_areas == MAX_VMALLOC_AREAS) {
+		RELEASE_VMALLOC(state);
+		return (NULL);
+	}
+
+	/* First fit, keeping a guard page after each area */
+	va = ARCH_VMALLOC_START;
+	i = 0;
+	while (i < nb_vmalloc_areas && (size_t)(vmalloc_areas[i].start - va) < size + PAGE_SIZE)
+	{
+		va = vmalloc_areas[i].start + vmalloc_areas[i].size + PAGE_SIZE;
+		++i;
+	}
+	if ((size_t)(ARCH_VMALLOC_END - va) < size + PAGE_SIZE) {
+		RELEASE_VMALLOC(state);
+		return (NULL);
+	}
+	memmove(vmalloc_areas + i + 1, vmalloc_areas + i, (nb_vmalloc_areas - i) * sizeof(*vmalloc_areas));
+	vmalloc_areas[i].start = va;
+	vmalloc_areas[i].size = size;
+	++nb_vmalloc_areas;
+	RELEASE_VMALLOC(state);
+
+	if (mmap(va, size, MMAP_WRITE) == NULL)
+	{
+		LOCK_VMALLOC(state2);
+		i = vmalloc_lookup(va);
+		memmove(vmalloc_areas + i, vmalloc_areas + i + 1, (nb_vmalloc_areas - i - 1) * sizeof(*vmalloc_areas));
+		--nb_vmalloc_areas;
+		RELEASE_VMALLOC(state2);
+		return (NULL);
+	}
+	return (va);
+}
+
+/*
+** Frees an area given by vmalloc(), unmapping it.
+*/
+void
+vfree(virt_addr_t va)
+{
+	size_t i;
+	size_t size;
+
+	LOCK_VMALLOC(state);
+	i = vmalloc_lookup(va);
+	assert(i < nb_vmalloc_areas && vmalloc_areas[i].start == va);
+	size = vmalloc_areas[i].size;
+	RELEASE_VMALLOC(state);
+
+	/* The addresses can't be reused before they are unmapped */
+	munmap(va, size);
+
+	LOCK_VMALLOC(state2);
+	i = vmalloc_lookup(va);
+	memmove(vmalloc_areas + i, vmalloc_areas + i + 1, (nb_vmalloc_areas - i - 1) * sizeof(*vmalloc_areas));
+	--nb_vmalloc_areas;
+	RELEASE_VMALLOC(state2);
+}
+
+/*
+** Resizes an area given by vmalloc() without moving it, to 'size' bytes rounded
+** up to a page. The pages past the new size are unmapped when it shrinks, and the
+** following addresses are mapped when it grows, if the guard page before the next
+** area can be kept.
+** Returns false if the area has to be moved.
+*/
+bool
+vresize(virt_addr_t va, size_t size)
+{
+	virt_addr_t end;
+	size_t old;
+	size_t i;
+
+	size = ALIGN(size + (size == 0), PAGE_SIZE);
+
+	LOCK_VMALLOC(state);
+	i = vmalloc_lookup(va);
+	assert(i < nb_vmalloc_areas && vmalloc_areas[i].start == va);
+	old = vmalloc_areas[i].size;
+	if (size > old)
+	{
+		end = (i + 1 < nb_vmalloc_areas) ? vmalloc_areas[i + 1].start : ARCH_VMALLOC_END;
+		if ((size_t)(end - va) < size + PAGE_SIZE) {
+			RELEASE_VMALLOC(state);
+			return (false);
+		}
+
+		/* The new addresses are taken before they are mapped */
+		vmalloc_areas[i].size = size;
+	}
+	RELEASE_VMALLOC(state);
+
+	if (size > old && mmap(va + old, size - old, MMAP_WRITE) == NULL)
+	{
+		LOCK_VMALLOC(state2);
+		vmalloc_areas[vmalloc_lookup(va)].size = old;
+		RELEASE_VMALLOC(state2);
+		return (false);
+	}
+	else if (size < old)
+	{
+		/* The addresses can't be reused before they are unmapped */
+		munmap(va + size, old - size);
+
+		LOCK_VMALLOC(state2);
+		vmalloc_areas[vmalloc_lookup(va)].size = size;
+		RELEASE_VMALLOC(state2);
+	}
+	return (true);
+}
+
+/*
+** Returns the size of the given area of vmalloc(), rounded up to a page.
+*/
+size_t
+vmalloc_size(virt_addr_t va)
+{
+	size_t i;
+	size_t size;
+
+	LOCK_VMALLOC(state);
+	i = vmalloc_lookup(va);
+	assert(i < nb_vmalloc_areas && vmalloc_areas[i].start == va);
+	size = vmalloc_areas[i].size;
+	RELEASE_VMALLOC(state);
+	return (size);
+}
+
+/*
+** Tells if the given address belongs to the addresses of vmalloc().
+*/
+bool
+is_vmalloc_addr(virt_addr_t va)
+{
+	return (va >= ARCH_VMALLOC_START && va < ARCH_VMALLOC_END);
+}
+
 /*
 ** Initalises the arch-independant stuff of virtual memory management.
 ** Calls the arch-dependent vmm init function.
@@ -218,16 +618,34 @@ usbrk(intptr inc)
 static void
 vmm_init(enum init_level il __unused)
 {
+	size_t offset;
+	uint order;
+
 	/* Some assertions that can't be static_assert() */
 	assert(IS_PAGE_ALIGNED(KERNEL_VIRTUAL_LINK));
 	assert(IS_PAGE_ALIGNED(KERNEL_VIRTUAL_BASE));
 	assert(IS_PAGE_ALIGNED(KERNEL_VIRTUAL_END));
 	assert(IS_PAGE_ALIGNED(KERNEL_PHYSICAL_END));
 
-	/* Set-up kernel heap */
-	kernel_heap_start = KERNEL_VIRTUAL_END + PAGE_SIZE;
+	/* Set-up kernel heap, after the memory mapped at boot */
+	kernel_heap_start = (uchar *)KERNEL_VIRTUAL_BASE + ARCH_BOOT_MAPPING_SIZE;
 	kernel_heap_size = 0;
 
+	kpages_brk = ARCH_KPAGES_START;
+	kpages_top = ARCH_KPAGES_END;
+	offset = 0;
+	order = 0;
+	while (order <= PMM_MAX_ORDER)
+	{
+		kpages_free[order] = kpages_bitmap + offset;
+		kpages_hint[order] = 0;
+		offset += (KPAGES_NB_PAGES >> order) / 32u + 1u;
+		++order;
+	}
+	assert(offset <= KPAGES_BITMAP_SIZE);
+	init_lock(&vmalloc_lock);
+	nb_vmalloc_areas = 0;
+
 	arch_vmm_init();
 
 	/* Allocate the first heap page or the kbrk algorithm will not work. */
@@ -0,0 +1,323 @@
+/* ------------------------------------------------------------------------ *\
+**
+**  This file is part of the Chaos Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2017 - Benjamin Grange <benjamin.grange@epitech.eu>
+**
+\* ------------------------------------------------------------------------ */
+
+#include <kernel/zero_pool.h>
+#include <kernel/thread.h>
+#include <kernel/spinlock.h>
+#include <kernel/interrupts.h>
+#include <kernel/unit-tests.h>
+#include <kernel/vmm.h>
+
+/*
+** A pool of frames cleared ahead of time, so that mapping a new page doesn't
+** have to clear it while holding the address space lock with interrupts disabled.
+**
+** The pool is refilled by a kernel thread that clears one frame at a time with
+** interrupts enabled, and yields the cpu right after. It runs at the lowest
+** priority, so it only gets the cpu when the other threads don't need it, and
+** sleeps once the pool is full until it drops below ZERO_POOL_LOW_WATERMARK.
+**
+** Once the pool of frames is full, the thread also clears blocks big enough to
+** back a large page, one frame at a time. Large pages are only used when such a
+** block is ready, as clearing one inline would take far too long.
+** As each block keeps a lot of memory aside, one is only cleared after a large
+** mapping asked for it and found none, and isn't replaced once it is used.
+*/
+
+static phys_addr_t		pool[ZERO_POOL_SIZE];
+static size_t			pool_size;
+static size_t			pool_hits;
+static size_t			pool_misses;
+static phys_addr_t		large_pool[ZERO_POOL_LARGE_SIZE];
+static size_t			large_pool_size;
+static size_t			large_wanted;			/* Number of blocks to keep in the pool */
+static phys_addr_t		large_pending = NULL_FRAME;	/* Block being cleared */
+static size_t			large_pending_done;		/* Number of frames of it cleared */
+static struct spinlock		pool_lock;
+
+/* The thread refilling the pool, while it is sleeping */
+static struct list_node		refill_wait_queue = LIST_INIT_VALUE(refill_wait_queue);
+
+extern struct spinlock		thread_table_lock;
+
+# define LOCK_ZERO_POOL(state)		LOCK(&pool_lock, state)
+# define RELEASE_ZERO_POOL(state)	RELEASE(&pool_lock, state)
+
+/*
+** Takes a pre-zeroed frame from the pool.
+** Returns NULL_FRAME if the pool is empty, in which case the caller has to
+** clear the frame it allocates itself.
+*/
+phys_addr_t
+zero_pool_get(void)
+{
+#ifdef ENABLE_PAGE_POISON
+	return (NULL_FRAME);
+#else
+	phys_addr_t pa;
+	bool low;
+
+	LOCK_ZERO_POOL(state);
+	if (pool_size) {
+		pa = pool[--pool_size];
+		++pool_hits;
+	} else {
+		pa = NULL_FRAME;
+		++pool_misses;
+	}
+	low = (pool_size < ZERO_POOL_LOW_WATERMARK);
+	RELEASE_ZERO_POOL(state);
+
+	/*
+	** The caller may hold locks with interrupts disabled, so the refilling thread
+	** is only made runnable here, and runs once the cpu is idle.
+	*/
+	if (low) {
+		thread_wakeup(&refill_wait_queue);
+	}
+	return (pa);
+#endif
+}
+
+/*
+** Takes a pre-zeroed block of physically contiguous frames, big enough to back
+** a large page, from the pool.
+** Returns NULL_FRAME if none is ready, in which case one is prepared for the
+** next call.
+*/
+phys_addr_t
+zero_pool_get_large(void)
+{
+#ifdef ENABLE_PAGE_POISON
+	return (NULL_FRAME);
+#else
+	phys_addr_t pa;
+
+	LOCK_ZERO_POOL(state);
+	if (large_pool_size) {
+		pa = large_pool[--large_pool_size];
+		--large_wanted;
+	} else {
+		pa = NULL_FRAME;
+		large_wanted = MIN(large_wanted + 1, ZERO_POOL_LARGE_SIZE);
+	}
+	RELEASE_ZERO_POOL(state);
+
+	if (pa == NULL_FRAME) {
+		thread_wakeup(&refill_wait_queue);
+	}
+	return (pa);
+#endif
+}
+
+/*
+** Clears a new frame and adds it to the pool.
+** Returns false if the pool is full, or if physical memory is too low to
+** keep frames aside.
+*/
+static bool
+refill_frames(void)
+{
+	phys_addr_t pa;
+
+	LOCK_ZERO_POOL(state);
+	if (pool_size == ZERO_POOL_SIZE || nb_free_frames() <= ZERO_POOL_SIZE) {
+		RELEASE_ZERO_POOL(state);
+		return (false);
+	}
+	pa = alloc_frame();
+	RELEASE_ZERO_POOL(state);
+
+	if (pa == NULL_FRAME) {
+		return (false);
+	}
+
+	/* This is the slow part, and it is done with interrupts enabled */
+	arch_zero_frame(pa);
+
+	LOCK_ZERO_POOL(state2);
+	assert(pool_size < ZERO_POOL_SIZE);
+	pool[pool_size++] = pa;
+	RELEASE_ZERO_POOL(state2);
+	return (true);
+}
+
+/*
+** Clears the next frame of the block being prepared for a large page, starting
+** a new one if needed, and adds it to the pool once it is fully cleared.
+** Returns false if the pool holds as many blocks as were asked for, or if
+** physical memory is too low to keep a block aside.
+*/
+static bool
+refill_large(void)
+{
+	phys_addr_t pa;
+
+	LOCK_ZERO_POOL(state);
+	if (large_pending == NULL_FRAME)
+	{
+		if (large_pool_size >= large_wanted
+			|| nb_free_frames() <= ZERO_POOL_SIZE + (1u << ARCH_LARGE_PAGE_ORDER)) {
+			RELEASE_ZERO_POOL(state);
+			return (false);
+		}
+		large_pending = alloc_frames(ARCH_LARGE_PAGE_ORDER);
+		large_pending_done = 0;
+		if (large_pending == NULL_FRAME) {
+			RELEASE_ZERO_POOL(state);
+			return (false);
+		}
+	}
+	pa = large_pending + large_pending_done * PAGE_SIZE;
+	RELEASE_ZERO_POOL(state);
+
+	arch_zero_frame(pa);
+
+	LOCK_ZERO_POOL(state2);
+	if (++large_pending_done == (1u << ARCH_LARGE_PAGE_ORDER))
+	{
+		assert(large_pool_size < ZERO_POOL_LARGE_SIZE);
+		large_pool[large_pool_size++] = large_pending;
+		large_pending = NULL_FRAME;
+	}
+	RELEASE_ZERO_POOL(state2);
+	return (true);
+}
+
+/*
+** Clears a frame for the pool, the single frames being refilled before the
+** blocks for large pages.
+** Returns false if there is nothing left to clear, or if physical memory is too low.
+*/
+bool
+zero_pool_refill(void)
+{
+	return (refill_frames() || refill_large());
+}
+
+/*
+** Fills the given structure with a snapshot of the pool's state.
+*/
+void
+zero_pool_get_stats(struct zero_pool_stats *stats)
+{
+	LOCK_ZERO_POOL(state);
+	stats->nb_frames = pool_size;
+	stats->hits = pool_hits;
+	stats->misses = pool_misses;
+	stats->nb_large = large_pool_size;
+	RELEASE_ZERO_POOL(state);
+}
+
+#ifndef ENABLE_PAGE_POISON
+
+/*
+** Entry point of the thread refilling the pool.
+** Fills the pool, then sleeps until zero_pool_get() wakes it up.
+*/
+static int
+zero_pool_routine(void)
+{
+	while (42)
+	{
+		while (zero_pool_refill()) {
+			thread_yield();
+		}
+		LOCK_THREAD(state);
+		thread_wait(&refill_wait_queue);
+		RELEASE_THREAD(state);
+	}
+	return (0);
+}
+
+#endif /* !ENABLE_PAGE_POISON */
+
+/*
+** Starts the thread refilling the pool.
+*/
+void
+zero_pool_start(void)
+{
+#ifndef ENABLE_PAGE_POISON
+	struct thread *t;
+
+	t = thread_create("zero_pool", &zero_pool_routine, DEFAULT_STACK_SIZE);
+	assert_neq(t, NULL);
+	thread_set_nice(t, SCHED_NB_PRIORITIES - 1);
+#endif
+}
+
+/*
+** Some unit tests for the pool of pre-zeroed frames.
+*/
+static void
+zero_pool_test(void)
+{
+#ifndef ENABLE_PAGE_POISON
+	struct zero_pool_stats stats;
+	struct zero_pool_stats old;
+	phys_addr_t pa;
+	size_t i;
+
+	zero_pool_get_stats(&old);
+	assert_eq(old.nb_frames, 0);
+	assert_eq(zero_pool_get(), NULL_FRAME);
+
+	/* Fill the pool */
+	while (zero_pool_refill());
+	zero_pool_get_stats(&stats);
+	assert_eq(stats.nb_frames, ZERO_POOL_SIZE);
+	assert_eq(stats.nb_large, 0);
+	assert_eq(stats.misses, old.misses + 1);
+
+	/* Blocks for large pages are only prepared once one was asked for */
+	assert_eq(zero_pool_get_large(), NULL_FRAME);
+	while (zero_pool_refill());
+	zero_pool_get_stats(&stats);
+	assert_eq(stats.nb_large, 1);
+
+	/* Frames coming out of it are cleared */
+	pa = zero_pool_get();
+	assert_neq(pa, NULL_FRAME);
+	assert_eq(arch_map_virt_to_phys((virt_addr_t)0xDEADB000, pa, MMAP_DEFAULT), OK);
+	i = 0;
+	while (i < PAGE_SIZE)
+	{
+		assert_eq(((uchar *)0xDEADB000)[i], 0);
+		++i;
+	}
+	munmap((virt_addr_t)0xDEADB000, PAGE_SIZE);
+
+	/* New pages are backed by the pool */
+	assert_eq(arch_map_page((virt_addr_t)0xDEADB000, MMAP_DEFAULT), OK);
+	assert_eq(*(uchar *)0xDEADB000, 0);
+	munmap((virt_addr_t)0xDEADB000, PAGE_SIZE);
+	zero_pool_get_stats(&stats);
+	assert_eq(stats.nb_frames, ZERO_POOL_SIZE - 2);
+	assert_eq(stats.hits, old.hits + 2);
+
+	/* Give the frames back */
+	while ((pa = zero_pool_get()) != NULL_FRAME) {
+		free_frame(pa);
+	}
+	pa = zero_pool_get_large();
+	assert_neq(pa, NULL_FRAME);
+	free_frames(pa, ARCH_LARGE_PAGE_ORDER);
+
+	/* It isn't replaced */
+	while (zero_pool_refill());
+	zero_pool_get_stats(&stats);
+	assert_eq(stats.nb_large, 0);
+	while ((pa = zero_pool_get()) != NULL_FRAME) {
+		free_frame(pa);
+	}
+#endif
+}
+
+NEW_UNIT_TEST(zero_pool, &zero_pool_test, UNIT_TEST_LEVEL_VMM);
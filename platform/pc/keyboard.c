@@ -9,6 +9,8 @@
 
 #include <kernel/init.h>
 #include <kernel/interrupts.h>
+#include <kernel/thread.h>
+#include <kernel/spinlock.h>
 #include <arch/x86/asm.h>
 #include <platform/pc/keyboard.h>
 #include <stdio.h>
@@ -54,6 +56,11 @@ static volatile char input_buffer[PAGE_SIZE] = { 0 };
 static volatile size_t input_write_idx = 0;
 static volatile size_t input_read_idx = 0;
 
+/* Threads waiting for a key to be pressed */
+static struct list_node input_wait_queue = LIST_INIT_VALUE(input_wait_queue);
+
+extern struct spinlock thread_table_lock;
+
 static enum handler_return
 keyboard_int_handler(void)
 {
@@ -68,20 +75,24 @@ keyboard_int_handler(void)
 			input_write_idx = (input_write_idx + 1) % PAGE_SIZE;
 		}
 	}
-	return (IRQ_RESCHEDULE);
+	return (thread_wakeup(&input_wait_queue) ? IRQ_RESCHEDULE : IRQ_NO_RESCHEDULE);
 }
 
 /*
-** Sends the next char or loops until the user presses a key.
+** Sends the next char, or sleeps until the user presses a key.
 */
 char
 keyboard_next_input(void)
 {
 	char c;
 
-	while (input_read_idx == input_write_idx);
+	LOCK_THREAD(state);
+	while (input_read_idx == input_write_idx) {
+		thread_wait(&input_wait_queue);
+	}
 	c = input_buffer[input_read_idx];
 	input_read_idx = (input_read_idx + 1) % PAGE_SIZE;
+	RELEASE_THREAD(state);
 	return (c);
 }
 
@@ -32,6 +32,15 @@ putc(char c)
 	write(1, &c, 1);
 }
 
+static void
+putnbr(uint32 nb)
+{
+	if (nb >= 10) {
+		putnbr(nb / 10);
+	}
+	putc('0' + nb % 10);
+}
+
 static char *
 strndup(char const *str, size_t n)
 {
@@ -87,6 +96,19 @@ get_ds(void)
 	return (ds);
 }
 
+/*
+** Low part of the timestamp counter, enough to time short operations.
+*/
+static inline uint32
+get_timestamp(void)
+{
+	uint32 lo;
+	uint32 hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (lo);
+}
+
 static bool
 is_in_usermode(void)
 {
@@ -188,11 +210,57 @@ exec_sigsev(void)
 	return (0);
 }
 
+/* Number of times the processes of 'pingpong' give the cpu to each other */
+# define PINGPONG_ROUNDS	1000u
+
+/*
+** Measures the cost of switching between two processes: both yield the cpu
+** back and forth, and the average time of a round is printed.
+*/
+static int
+exec_pingpong(void)
+{
+	pid_t pid;
+	uint32 start;
+	uint32 time;
+	uint i;
+
+	pid = fork();
+	assert_neq(pid, -1);
+	i = 0;
+	start = get_timestamp();
+	while (i < PINGPONG_ROUNDS)
+	{
+		yield();
+		++i;
+	}
+	time = get_timestamp() - start;
+	if (pid == 0) {
+		exit();
+	}
+	waitpid(pid);
+	puts("Average round: ");
+	putnbr(time / PINGPONG_ROUNDS);
+	puts(" cycles\n");
+	exit();
+	return (0);
+}
+
+static int
+exec_kmemstat(void)
+{
+	kmemstat();
+	exit();
+	return (0);
+}
+
 static struct cmd cmds[] =
 {
 	{"help", "print the help", &exec_help},
 	{"ls", "list filesystem", &exec_ls},
 	{"sigsev", "produces a segmentation fault", &exec_sigsev},
+	{"pingpong", "times the switch between two processes", &exec_pingpong},
+	{"kmemstat", "prints the state of the kernel memory allocators", &exec_kmemstat},
 
 	{NULL, NULL, NULL},
 };